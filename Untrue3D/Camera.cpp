@@ -2,25 +2,73 @@
 #include <windows.h>
 #include <chrono>
 #include <ctime>
+#include <cfloat>
+#include <climits>
+#include <algorithm>
 
 #include "UT3D.h"
 #include "Camera.h"
+#include "Profiler.h"
 #include "graphics.h"
 
 using namespace untrue;
 using namespace std;
 using namespace std::chrono;
+using Eigen::Map;
 
 Camera::Camera() {
+	name = "camera";
 	depthBuffer = nullptr;
 	frags = nullptr;
+	fragOwners = nullptr;
+	clearEpochs = nullptr;
+	clearEpoch = 1;
+	clearTilesX = 0;
+	memset(&clearDepth, 0x50, sizeof(float));
+	colorBuffer = nullptr;
+	backColorBuffer = nullptr;
+	presentTarget = nullptr;
+	shadingPresentTarget = nullptr;
+	floatTarget[0] = floatTarget[1] = floatTarget[2] = nullptr;
+	shadingFloatTarget[0] = shadingFloatTarget[1] = shadingFloatTarget[2] = nullptr;
+
+	frameInFlight = false;
+	frameCallback = nullptr;
 
 	__rasthreads = nullptr;
 	__framethreads = nullptr;
 
 	isPerspective = false;
 	isBackCulling = true;
+	isStatEnable = false;
 	reflactionEnabled = false;
+	clipPlaneEnabled = false;
+
+	stencilTriangles = nullptr;
+	stencilBuffer = nullptr;
+	stencilEnabled = false;
+	heatBuffer = nullptr;
+
+	vs = nullptr;
+	packedVs = nullptr;
+
+	visibilityEnabled = false;
+	visBuffer = nullptr;
+	tiledEnabled = false;
+	depthSortEnabled = false;
+	occlusionEnabled = false;
+	coarseX = coarseY = coarseStride = 0;
+	visibilitySets = nullptr;
+	clusterRecord = nullptr;
+	edgesDirty = true;
+	hiddenLine = true;
+	tilesX = tilesY = 0;
+
+	rasterPhase = RASTER_FULL;
+	prePassMode = PREPASS_AUTO;
+	prePassWanted = false;
+
+	renderStat = frameStat = shadingStat = Stat();
 
 	rotation.setZero();
 	projection.setIdentity();
@@ -28,17 +76,17 @@ Camera::Camera() {
 }
 
 Camera::~Camera() {
-	if (frags) {
-		delete[] depthBuffer[0];
-		delete[] depthBuffer;
-
+	waitForFrame();
+	//threads are woken to exit, so they go first
+	__killThreads();
+	__releaseDepthBuffers();
+	if (colorBuffer) {
 		delete[] colorBuffer[0];
 		delete[] colorBuffer;
-
-		delete[] frags[0];
-		delete[] frags;
 	}
-	__killThreads();
+	setDoubleBuffer(false);
+	if (stencilBuffer) delete[] stencilBuffer;
+	if (heatBuffer) delete[] heatBuffer;
 }
 
 //Must call once before render()
@@ -47,7 +95,7 @@ void Camera::setCamera(int width, int height, RenderMode renderMode) {
 	this->screenHeight = height;
 	this->renderMode = renderMode;
 
-	if (renderMode == NORMAL) {
+	if (renderMode != DEPTH) {
 		colorBuffer = new int*[screenHeight];
 		colorBuffer[0] = new int[screenHeight * screenWidth];
 		for (int i = 1;i < screenHeight;++i) {
@@ -55,35 +103,140 @@ void Camera::setCamera(int width, int height, RenderMode renderMode) {
 		}
 	}
 
-	screenMapping << width / 2.0, 0, 0, width / 2.0,
-		0, height / 2.0, 0, height / 2.0,
-		0, 0, 1, 0,
-		0, 0, 0, 1;
+	setViewport(width, height);
 
+	__releaseDepthBuffers();
+	__allocDepthBuffers();
+
+	if (heatBuffer) {
+		delete[] heatBuffer;
+		heatBuffer = new unsigned short[width * height * 2]();
+	}
+}
+
+//the visibility buffer replaces the depth and fragment buffers
+void Camera::__allocDepthBuffers() {
+	if (tiledEnabled) return; //tiles have their own
+	if (visibilityEnabled) {
+		visBuffer = new atomic<unsigned long long>[screenWidth * screenHeight];
+		return;
+	}
+	depthBuffer = new float*[screenHeight];
+	frags = new ver*[screenHeight];
+
+	depthBuffer[0] = new float[screenHeight * screenWidth];
+	frags[0] = new ver[screenHeight * screenWidth];
+	fragOwners = renderMode == NORMAL ? new int[screenHeight * screenWidth] : nullptr;
+
+	for (int i = 1;i < screenHeight;++i) {
+		depthBuffer[i] = depthBuffer[i - 1] + screenWidth;
+		frags[i] = frags[i - 1] + screenWidth;
+	}
+
+	//every tile is stale until it is drawn
+	clearTilesX = (screenWidth + CLEAR_TILE_WIDTH - 1) / CLEAR_TILE_WIDTH;
+	clearEpochs = new unsigned int[clearTilesX * screenHeight];
+	memset(clearEpochs, 0, sizeof(unsigned int) * clearTilesX * screenHeight);
+	clearEpoch = 1;
+}
+
+void Camera::__releaseDepthBuffers() {
 	if (frags) {
 		delete[] depthBuffer[0];
 		delete[] depthBuffer;
 		delete[] frags[0];
 		delete[] frags;
+		delete[] fragOwners;
+		depthBuffer = nullptr;
+		frags = nullptr;
+		fragOwners = nullptr;
+		delete[] clearEpochs;
+		clearEpochs = nullptr;
+	}
+	if (visBuffer) {
+		delete[] visBuffer;
+		visBuffer = nullptr;
 	}
+}
+
+void Camera::setVisibilityBuffer(bool enable) {
+	if (enable == visibilityEnabled || renderMode != NORMAL) return;
+	waitForFrame();
+	__releaseDepthBuffers();
+	visibilityEnabled = enable;
+	if (enable) tiledEnabled = false;
+	__allocDepthBuffers();
+}
 
-	depthBuffer = new float*[height];
-	frags = new ver*[height];
+void Camera::setHiddenLine(bool enable) {
+	hiddenLine = enable;
+}
 
-	depthBuffer[0] = new float[height * width];
-	frags[0] = new ver[height * width];
+void Camera::setDepthSort(bool enable) {
+	depthSortEnabled = enable;
+}
 
-	for (int i = 1;i < height;++i) {
-		depthBuffer[i] = depthBuffer[i - 1] + width;
-		frags[i] = frags[i - 1] + width;
-	}
+void Camera::setOcclusionCulling(bool enable) {
+	occlusionEnabled = enable;
+}
+
+void Camera::setVisibilitySets(const VisibilitySets* sets) {
+	visibilitySets = sets;
+}
+
+void Camera::setClusterRecord(unsigned char* bits) {
+	clusterRecord = bits;
+}
+
+int Camera::getClusterCount() {
+	return (int(ts->size()) + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+}
+
+void Camera::setTiledRendering(bool enable) {
+	if (enable == tiledEnabled || renderMode != NORMAL) return;
+	waitForFrame();
+	__releaseDepthBuffers();
+	tiledEnabled = enable;
+	if (enable) visibilityEnabled = false;
+	__allocDepthBuffers();
+}
+
+void Camera::setViewport(int width, int height) {
+	width = min(max(width, 1), screenWidth);
+	height = min(max(height, 1), screenHeight);
+	waitForFrame(); //the frame in flight is still shaded in the old viewport
+	this->viewportWidth = width;
+	this->viewportHeight = height;
+	screenMapping << width / 2.0, 0, 0, width / 2.0,
+		0, height / 2.0, 0, height / 2.0,
+		0, 0, 1, 0,
+		0, 0, 0, 1;
+}
+
+int Camera::getViewportWidth() {
+	return this->viewportWidth;
+}
+
+int Camera::getViewportHeight() {
+	return this->viewportHeight;
 }
 
 //set it false to optimize shadowmap
 void Camera::setBackCulling(bool backCulling) {
+	waitForFrame(); //tiles of the frame in flight are still rasterized with the old winding
 	isBackCulling = backCulling;
 }
 
+void Camera::setDepthPrePass(PrePassMode mode) {
+	prePassMode = mode;
+	prePassWanted = false;
+}
+
+bool Camera::isDepthPrePassActive() {
+	return renderMode == NORMAL && !visibilityEnabled && !tiledEnabled && (prePassMode == PREPASS_ON
+		|| (prePassMode == PREPASS_AUTO && prePassWanted));
+}
+
 //setting it true will enable statistics while rendering
 void Camera::setStatEnable(bool enable) {
 	isStatEnable = enable;
@@ -93,16 +246,53 @@ const Stat& Camera::getRenderStat() {
 	return renderStat;
 }
 
+void Camera::setHeatmapEnable(bool enable) {
+	if (enable == (heatBuffer != nullptr)) return;
+	waitForFrame();
+	if (enable) {
+		heatBuffer = new unsigned short[screenWidth * screenHeight * 2]();
+	} else {
+		delete[] heatBuffer;
+		heatBuffer = nullptr;
+	}
+}
+
+bool Camera::getHeatmap(HeatmapType type, unsigned int* target) {
+	static const unsigned int palette[7] = {
+		0x000000, 0x0000ff, 0x00ffff, 0x00ff00, 0xffff00, 0xff0000, 0xffffff
+	};
+	if (!heatBuffer) return false;
+	const unsigned short* hptr;
+	for (int y = 0;y < viewportHeight;++y) {
+		hptr = heatBuffer + y * screenWidth * 2 + (type == OVERDRAW);
+		for (int x = 0;x < viewportWidth;++x, hptr += 2) {
+			target[(viewportHeight - 1 - y) * viewportWidth + x] = palette[min(int(*hptr), 6)];
+		}
+	}
+	return true;
+}
+
 const RenderMode& Camera::getRenderMode() {
 	return renderMode;
 }
 
 void Camera::bindVertices(std::vector<ver, Eigen::aligned_allocator<ver> >* sceneVs) {
 	this->vs = sceneVs;
+	this->packedVs = nullptr;
+}
+
+void Camera::bindVertices(const PackedVertices* sceneVs) {
+	this->vs = nullptr;
+	this->packedVs = sceneVs;
 }
 
 void Camera::bindTriangles(std::vector<tri>* sceneTs) {
 	this->ts = sceneTs;
+	edgesDirty = true;
+}
+
+void Camera::invalidateEdges() {
+	edgesDirty = true;
 }
 
 void Camera::normalWorldToCamera(vec3& normal) {
@@ -119,19 +309,60 @@ void Camera::worldToScreen(vec4& v) {
 	v(3) = z;
 }
 
+void Camera::CVVToScreen(lanef& x, lanef& y, const lanef& w) {
+	if (isPerspective) {
+		lanef inv = w.inverse();
+		x *= inv;
+		y *= inv;
+	}
+	//screenMapping only scales and offsets x and y
+	x = screenMapping(0, 0) * x + screenMapping(0, 3);
+	y = screenMapping(1, 1) * y + screenMapping(1, 3);
+}
+
+const mat4& Camera::getWorldToCVV() {
+	return this->_worldToCVV;
+}
+
 void Camera::screenToWorld(vec4& v) {
+	screenToWorld(v, _CVVToWorld);
+}
+
+//same as above but with a given inverse transform, used by the frame threads
+void Camera::screenToWorld(vec4& v, const mat4& CVVToWorld) {
 	float z = v(3);
-	v(0) = v(0) / screenWidth * 2.0f - 1.0f;
-	v(1) = v(1) / screenHeight * 2.0f - 1.0f;
+	v(0) = v(0) / viewportWidth * 2.0f - 1.0f;
+	v(1) = v(1) / viewportHeight * 2.0f - 1.0f;
 	if (isPerspective) {
 		v(0) *= z;
 		v(1) *= z;
 		v(2) = (z * n + z * f - 2.0f * n * f) / (f - n);
 	}
-	v = _CVVToWorld * v;
+	v = CVVToWorld * v;
+}
+
+//screenToWorld() is linear in x along a row, so it splits into the terms below
+void Camera::getRowRays(int y, const mat4& CVVToWorld, vec4* rays) {
+	float cy = 2.0f * y / viewportHeight - 1.0f;
+	vec4 step = 2.0f / viewportWidth * CVVToWorld.col(0);
+	if (isPerspective) {
+		//CVV coordinate is (cx * z, cy * z, z * (n + f) / (f - n) - 2nf / (f - n), z)
+		rays[0] = -CVVToWorld.col(0) + cy * CVVToWorld.col(1)
+			+ (n + f) / (f - n) * CVVToWorld.col(2) + CVVToWorld.col(3);
+		rays[1] = step;
+		rays[2] = -2.0f * n * f / (f - n) * CVVToWorld.col(2);
+		rays[3].setZero();
+	} else {
+		//CVV coordinate is (cx, cy, 1, z)
+		rays[0] = CVVToWorld.col(3);
+		rays[1].setZero();
+		rays[2] = -CVVToWorld.col(0) + cy * CVVToWorld.col(1) + CVVToWorld.col(2);
+		rays[3] = step;
+	}
 }
 
 void Camera::setReflaction(const mat4& reflaction) {
+	waitForFrame();
 	this->reflactionEnabled = true;
 	this->isBackCulling = !this->isBackCulling;
 	this->reflaction = reflaction;
@@ -139,12 +370,43 @@ void Camera::setReflaction(const mat4& reflaction) {
 
 void Camera::reflactionEnable(bool enable) {
 	if (enable != this->reflactionEnabled) {
+		waitForFrame();
 		this->isBackCulling = !this->isBackCulling;
 	}
 	this->reflactionEnabled = enable;
 }
 
+void Camera::setClipPlane(const vec4& plane) {
+	this->clipPlaneEnabled = true;
+	this->clipPlane = plane;
+}
+
+void Camera::clipPlaneEnable(bool enable) {
+	this->clipPlaneEnabled = enable;
+}
+
+void Camera::setStencil(const std::vector<tri>* ts) {
+	this->stencilTriangles = ts;
+}
+
+//orthogonal projection keeps its own screen size
+void Camera::copyView(const Camera& other) {
+	this->position = other.position;
+	this->lookat = other.lookat;
+	this->up = other.up;
+	this->rotation = other.rotation;
+	if (other.isPerspective) {
+		if (!isPerspective || fov != other.fov || n != other.n || f != other.f) {
+			setPerspective(other.fov, other.n, other.f);
+		}
+	} else if (isPerspective || f != other.f) {
+		setOrthogonal(other.f);
+	}
+}
+
 void Camera::setPerspective(float fov, float n, float f) {
+	//the frame threads still interpolate and rebuild positions of the frame in flight
+	waitForFrame();
 	this->isPerspective = true;
 
 	this->fov = fov;
@@ -163,6 +425,7 @@ void Camera::setPerspective(float fov, float n, float f) {
 }
 
 void Camera::setOrthogonal(float depth) {
+	waitForFrame(); //see setPerspective()
 	this->isPerspective = false;
 	n = 0; f = depth;
 	projection << 2.0f / screenWidth, 0, 0, 0, //[-1, 1]
@@ -171,19 +434,76 @@ void Camera::setOrthogonal(float depth) {
 		0, 0, 1.0f, 0;
 }
 
+//nullptr with the visibility buffer
 float* Camera::getDepthBuffer() {
+	if (!this->depthBuffer) return nullptr;
+	__resolveClears();
 	return this->depthBuffer[0];
 }
 
+void Camera::__clearSpan(int y, int left, int right) {
+	unsigned int* eptr = clearEpochs + y * clearTilesX;
+	for (int t = left / CLEAR_TILE_WIDTH;t <= right / CLEAR_TILE_WIDTH;++t) {
+		if (eptr[t] == clearEpoch) continue;
+		eptr[t] = clearEpoch;
+		int x = t * CLEAR_TILE_WIDTH;
+		memset(&depthBuffer[y][x], 0x50, sizeof(float) * min(CLEAR_TILE_WIDTH, screenWidth - x));
+	}
+}
+
+//the whole buffer is read outside, so the tiles nothing touched are cleared at last
+void Camera::__resolveClears() {
+	if (!clearEpochs) return;
+	for (int y = 0;y < screenHeight;++y) {
+		__clearSpan(y, 0, screenWidth - 1);
+	}
+}
+
 //retrun screen space vertex array after early-z
 ver* Camera::getFragBuffer() {
-	return this->frags[0];
+	return this->frags ? this->frags[0] : nullptr;
 }
 
 const int* Camera::getColorBuffer() {
 	return this->colorBuffer[0];
 }
 
+void Camera::setName(const char* name) {
+	this->name = name;
+}
+
+const char* Camera::getName() {
+	return this->name;
+}
+
+void Camera::setDoubleBuffer(bool enable) {
+	if (enable == (backColorBuffer != nullptr) || renderMode != NORMAL) return;
+	waitForFrame();
+	if (enable) {
+		backColorBuffer = new int*[screenHeight];
+		backColorBuffer[0] = new int[screenHeight * screenWidth]();
+		for (int i = 1;i < screenHeight;++i) {
+			backColorBuffer[i] = backColorBuffer[i - 1] + screenWidth;
+		}
+	} else {
+		delete[] backColorBuffer[0];
+		delete[] backColorBuffer;
+		backColorBuffer = nullptr;
+	}
+}
+
+//the target must hold screenWidth * viewportHeight pixels in 0xRRGGBB format
+void Camera::setPresentTarget(unsigned int* target) {
+	this->presentTarget = target;
+}
+
+//every plane must hold viewportWidth * viewportHeight floats
+void Camera::setFloatTarget(float* r, float* g, float* b) {
+	floatTarget[0] = r;
+	floatTarget[1] = g;
+	floatTarget[2] = b;
+}
+
 int Camera::getScreenWidth() {
 	return this->screenWidth;
 }
@@ -194,7 +514,7 @@ int Camera::getScreenHeight() {
 
 //return rotation matrix base on Camera::rotation
 mat3 Camera::getRotation() {
-	const float k = -ege::PI / 180.0f; //ȡתΪ
+	const float k = -ege::PI / 180.0f; //取反方向并转为弧度
 	float c[3], s[3]; //cosine and sine
 	for (int i = 0;i < 3;++i) {
 		c[i] = std::cos(k * rotation(i));
@@ -263,6 +583,11 @@ void Camera::updateCameraState() {
 
 	_worldToCVV = projection * viewTransform;
 	_CVVToWorld = _worldToCVV.inverse();
+
+	//plane in clip space, distances are linear in clip coordinates as well
+	if (this->clipPlaneEnabled) {
+		_clipPlaneCVV = _CVVToWorld.transpose() * clipPlane;
+	}
 }
 
 int Camera::_getClipCode(const vec4& p) {
@@ -279,22 +604,128 @@ int Camera::_getClipCode(const vec4& p) {
 	return code;
 }
 
+void Camera::__transformVertices(const float* x, const float* y, const float* z, int size) {
+	ProfileZone zone("transform", name);
+	int padded = (size + LANE_SIZE - 1) / LANE_SIZE * LANE_SIZE;
+	clipX.resize(padded); clipY.resize(padded); clipZ.resize(padded); clipW.resize(padded);
+	clipCodes.resize(padded);
+	const mat4& m = _worldToCVV;
+	const vec4& plane = _clipPlaneCVV;
+	float scaleX = screenMapping(0, 0), offsetX = screenMapping(0, 3),
+		scaleY = screenMapping(1, 1), offsetY = screenMapping(1, 3);
+	lanef cx, cy, cz, cw, ref, sx, sy, sz, sw;
+	lanei codes;
+	for (int i = 0;i < padded;i += LANE_SIZE) {
+		lanef px = Map<const lanef>(x + i), py = Map<const lanef>(y + i), pz = Map<const lanef>(z + i);
+		cx = m(0, 0) * px + m(0, 1) * py + m(0, 2) * pz + m(0, 3);
+		cy = m(1, 0) * px + m(1, 1) * py + m(1, 2) * pz + m(1, 3);
+		cz = m(2, 0) * px + m(2, 1) * py + m(2, 2) * pz + m(2, 3);
+		cw = m(3, 0) * px + m(3, 1) * py + m(3, 2) * pz + m(3, 3);
+		Map<lanef>(clipX.data() + i) = cx;
+		Map<lanef>(clipY.data() + i) = cy;
+		Map<lanef>(clipZ.data() + i) = cz;
+		Map<lanef>(clipW.data() + i) = cw;
+
+		//the same planes as _getClipCode()
+		ref = isPerspective ? cw : lanef::Ones();
+		codes = (cx < -ref).cast<int>() + (cx > ref).cast<int>() * 2
+			+ (cy < -ref).cast<int>() * 4 + (cy > ref).cast<int>() * 8
+			+ (cz < -ref).cast<int>() * 16 + (cz > ref).cast<int>() * 32;
+		if (clipPlaneEnabled) {
+			codes += (plane(0) * cx + plane(1) * cy + plane(2) * cz + plane(3) * cw < 0.0f).cast<int>() * 64;
+		}
+		for (int k = 0;k < LANE_SIZE;++k) clipCodes[i + k] = codes(k);
+
+		//1 / w is kept for perspective interpolation, w for orthogonal cameras
+		if (isPerspective) {
+			sw = cw.inverse();
+			sx = cx * sw * scaleX + offsetX;
+			sy = cy * sw * scaleY + offsetY;
+			sz = cz * sw;
+		} else {
+			sw = cw;
+			sx = cx * scaleX + offsetX;
+			sy = cy * scaleY + offsetY;
+			sz = cz;
+		}
+		for (int k = 0;k < LANE_SIZE && i + k < size;++k) {
+			//vertices behind the eye stay in clip space, only clipped copies are used
+			if (isPerspective && cw(k) <= 0.0f) {
+				vBuffer[i + k].position << cx(k), cy(k), cz(k), cw(k);
+			} else {
+				vBuffer[i + k].position << sx(k), sy(k), sz(k), sw(k);
+			}
+		}
+	}
+}
+
+void Camera::__clipSpacePosition(int index, vec4& p) {
+	p << clipX[index], clipY[index], clipZ[index], clipW[index];
+}
+
 //Make line ab clip at near plane
 void Camera::nearClip(ver& a, ver& b) {
 	ver delta = b - a;
 	a += delta * (this->n - a.position(3)) / delta.position(3);
 }
 
-//Solve near-clip triangles and store new triangles into tBuffer
+//Clip triangle by the user clip plane first, the rest goes to near clipping
 //No support for multithreading
 void Camera::triangleClip(tri ta) {
+	if (!clipPlaneEnabled) {
+		nearTriangleClip(ta);
+		return;
+	}
+	//counted only once, even when cut again by the near plane
+	float d[3];
+	int outside = 0, k, size = vBuffer.size();
+	for (int i = 0;i < 3;++i) {
+		d[i] = _clipPlaneCVV.dot(vBuffer[ta(i)].position);
+		if (d[i] < 0) ++outside;
+	}
+	if (outside == 0) {
+		nearTriangleClip(ta);
+		return;
+	}
+	if (outside == 3) {
+		if (isStatEnable) ++frameStat.trianglesRejected;
+		return;
+	}
+	if (isStatEnable) ++frameStat.trianglesClipped;
+	//get the special vertex index, the only one outside or the only one inside
+	for (k = 0;k <= 2;++k) {
+		if ((d[k] < 0) == (outside == 1)) {
+			break;
+		}
+	}
+	int next = (k + 1) % 3, prev = (k + 2) % 3;
+	ver v(vBuffer[ta(k)]),
+		va(v + (vBuffer[ta(next)] - v) * (d[k] / (d[k] - d[next]))),
+		vb(v + (vBuffer[ta(prev)] - v) * (d[k] / (d[k] - d[prev])));
+	vBuffer.emplace_back(va); //size
+	vBuffer.emplace_back(vb); //size + 1
+	if (outside == 1) { //the rest is a quad
+		nearTriangleClip(tri(size, ta(next), ta(prev)));
+		nearTriangleClip(tri(size, ta(prev), size + 1));
+	} else {
+		nearTriangleClip(tri(ta(k), size, size + 1));
+	}
+}
+
+//Solve near-clip triangles and store new triangles into tBuffer
+//No support for multithreading
+void Camera::nearTriangleClip(tri ta) {
 	int codes[3], code = 0;
 	for (int i = 0;i < 3;++i) {
 		codes[i] = _getClipCode(vBuffer[ta(i)].position);
 		code ^= codes[i];
 	}
-	if (codes[0] & codes[1] & codes[2]) return; //all out of CVV
+	if (codes[0] & codes[1] & codes[2]) { //all out of CVV
+		if (isStatEnable) ++frameStat.trianglesRejected;
+		return;
+	}
 	if ((codes[0] & 16) || (codes[1] & 16) || (codes[2]) & 16) {
+		if (isStatEnable) ++frameStat.trianglesClipped;
 		//one or two vertices clip at near plane
 		int left = code & 16 ? 16 : 0, right, k, size = vBuffer.size();
 		//get the special vertex index
@@ -357,7 +788,12 @@ void Camera::__initThreads() {
 
 void Camera::__resumeAllThreads(const char* type) {
 	if (type == "rasterize") {
-		renderingFace.store(0); //statistics data
+		nextRasterJob.store(0);
+		if (rasterPhase == RASTER_FULL || rasterPhase == RASTER_DEPTH) { //counted by the depth round only
+			fragmentTested.store(0);
+			fragmentPassed.store(0);
+			fragmentOverwritten.store(0);
+		}
 		rasFinished.store(0);
 		for (int i = 0;i < RASTHREAD_SIZE;++i) {
 			rasReady[i].store(true);
@@ -365,6 +801,9 @@ void Camera::__resumeAllThreads(const char* type) {
 		threadRasCon.notify_one();
 	} else if (type == "frame") {
 		frameFinished.store(0);
+		fragmentShaded.store(0);
+		lightEvaluation.store(0);
+		frameCompleted.store(false);
 		for (int i = 0;i < FRAMETHREAD_SIZE;++i) {
 			frameReady[i].store(true);
 		}
@@ -375,15 +814,21 @@ void Camera::__resumeAllThreads(const char* type) {
 //wait until all rasterizing threads finish their works
 void Camera::__waitForAllThreads(const char* type) {
 	if (type == "rasterize") {
+		ProfileZone zone("wait rasterize", name);
 		unique_lock<mutex> locker(rasmutex);
 		while (rasFinished != RASTHREAD_SIZE) mainRasCon.wait_for(locker, chrono::milliseconds(30));
 		locker.unlock();
 
 		//record statistical data
-		renderStat.renderingFaces = renderingFace.load();
+		frameStat.renderingFaces = renderingFace.load();
+		frameStat.trianglesCulled = tBuffer.size() - frameStat.renderingFaces;
+		frameStat.fragmentsTested = fragmentTested.load();
+		frameStat.fragmentsPassed = fragmentPassed.load();
+		frameStat.fragmentsOverwritten = fragmentOverwritten.load();
 	} else if (type == "frame") {
+		ProfileZone zone("wait frame", name);
 		unique_lock<mutex> locker(framemutex);
-		while (frameFinished != FRAMETHREAD_SIZE) mainFrameCon.wait_for(locker, chrono::milliseconds(30));
+		while (!frameCompleted.load()) mainFrameCon.wait_for(locker, chrono::milliseconds(30));
 		locker.unlock();
 	}
 }
@@ -394,6 +839,8 @@ void Camera::__killThreads() {
 		for (int i = 0;i < RASTHREAD_SIZE;++i) {
 			__rasthreadState[i] = EXIT;
 		}
+		//no jobs of the last frame are run again on the way out
+		rasterJobs.clear();
 		__resumeAllThreads("rasterize");
 		for (int i = 0;i < RASTHREAD_SIZE;++i) {
 			__rasthreads[i].join();
@@ -403,6 +850,7 @@ void Camera::__killThreads() {
 		__rasthreads = nullptr;
 	}
 	if (__framethreads) {
+		frameCallback = nullptr;
 		for (int i = 0;i < FRAMETHREAD_SIZE;++i) {
 			__framethreadState[i] = EXIT;
 		}
@@ -439,153 +887,893 @@ static inline int getColorValue(const vec3& c) {
 		| int(c(2));
 }
 
+//bits of subpixel precision, fewer for huge triangles so that fixed point
+//coordinates stay under 2^29 and edge products never overflow 64 bits
+static const int _SUBPIXEL_BITS = 8;
+static const float _FIXED_LIMIT = float(1 << 29);
+
+//b > 0
+static inline long long _floorDiv(long long a, long long b) {
+	long long q = a / b;
+	return q * b > a ? q - 1 : q;
+}
+
+//edge function from p0 to p1 at pixel (x, y), a pixel is covered when it's not negative
+//for all three edges, inside is on the left of the edge
+static inline long long _edgeFunction(long long x0, long long y0, long long x1, long long y1,
+	int x, int y, int bits) {
+	long long dx = x1 - x0, dy = y1 - y0;
+	//pixels exactly on a top or left edge are in, the other triangle
+	//sharing the edge walks it the other way and leaves them out
+	bool topLeft = dy < 0 || (dy == 0 && dx < 0);
+	return dx * (((long long)y << bits) - y0) - dy * (((long long)x << bits) - x0) - (topLeft ? 0 : 1);
+}
+
+//an edge function walked row by row with integer adds only, the span bound of a
+//sloped edge is the quotient of the edge function by its step along the row
+enum EdgeKind {
+	EDGE_FLAT, //horizontal, the whole row is in or out
+	EDGE_LEFT, //bounds the span from the left
+	EDGE_RIGHT //bounds the span from the right
+};
+struct FixedEdge {
+	EdgeKind kind;
+	long long q, rem, den, qStep, remStep; //sloped edges, 0 <= rem < den
+	long long e, eStep; //horizontal edges
+
+	//edge from p0 to p1 evaluated at pixel (x, y)
+	void setup(long long x0, long long y0, long long x1, long long y1, int x, int y, int bits) {
+		long long dx = x1 - x0, dy = y1 - y0;
+		e = _edgeFunction(x0, y0, x1, y1, x, y, bits);
+		eStep = dx << bits; //per row
+		long long xStep = -dy << bits; //per pixel
+		if (xStep == 0) {
+			kind = EDGE_FLAT;
+			return;
+		}
+		kind = xStep > 0 ? EDGE_LEFT : EDGE_RIGHT;
+		den = xStep > 0 ? xStep : -xStep;
+		q = _floorDiv(e, den);
+		rem = e - q * den;
+		qStep = _floorDiv(eStep, den);
+		remStep = eStep - qStep * den;
+	}
+
+	//clip the span [l, r] of the current row, then move to the next row
+	void step(long long& l, long long& r) {
+		if (kind == EDGE_FLAT) {
+			if (e < 0) r = -1;
+			e += eStep;
+			return;
+		}
+		//e + k * xStep >= 0 is k >= -q on a left edge and k <= q on a right one
+		if (kind == EDGE_LEFT) l = max(l, -q);
+		else r = min(r, q);
+		q += qStep;
+		rem += remStep;
+		if (rem >= den) {
+			rem -= den;
+			++q;
+		}
+	}
+};
+
 //multi-thread rasterizing algorithm
-//TODO: little line gaps when the triangle is flat in screen space
-void Camera::rasterizeTriangle(const tri& t) {
-	ver a(vBuffer[t(0)]), b(vBuffer[t(1)]), c(vBuffer[t(2)]);
+//edges are in fixed point with a top-left fill rule, so that triangles sharing an edge
+//cover each of its pixels exactly once
+//attributes stepped by the rasterizer, only what the shading of the material reads
+//lane 0 is 1 / depth with perspective or the depth, lanes 1-3 the normal
+//and lanes 4-6 the color or lanes 4-5 the uv
+enum InterpolationPlan {
+	PLAN_DEPTH, //depth maps
+	PLAN_COLOR, //untextured materials
+	PLAN_TEXTURE
+};
+
+static inline void _toLanes(const ver& v, InterpolationPlan plan, bool isPerspective, lanef& lanes) {
+	lanes.setZero();
+	lanes(0) = v.position(3);
+	if (plan == PLAN_DEPTH) return;
+	lanes.segment<3>(1) = v.normal.array();
+	if (plan == PLAN_TEXTURE) {
+		lanes.segment<2>(4) = v.uv.array();
+	} else {
+		lanes.segment<3>(4) = v.color.array();
+	}
+	//perspective correction, divided by the interpolated lane 0 per fragment
+	if (isPerspective) lanes.tail<LANE_SIZE - 1>() *= v.position(3);
+}
+
+//fragments of a span reaching the depth test, the stencil rejects the rest before it
+static inline int _testedCount(const unsigned char* stencil, int count) {
+	if (!stencil) return count;
+	int tested = 0;
+	for (int i = 0;i < count;++i) tested += stencil[i] != 0;
+	return tested;
+}
+
+static inline void _writeFragment(ver* frag, const lanef& v, float pz, InterpolationPlan plan,
+	bool isPerspective, int texIndex, bool receiveShadow) {
+	lanef attr = isPerspective ? v * pz : v;
+	frag->normal << attr(1), attr(2), attr(3);
+	if (plan == PLAN_TEXTURE) {
+		frag->uv << attr(4), attr(5);
+	} else {
+		frag->color << attr(4), attr(5), attr(6);
+	}
+	frag->texIndex = texIndex;
+	frag->receiveShadow = receiveShadow;
+}
+
+//position, color, normal and uv are packed into float lanes by the plan of the
+//triangle, so that a step is a single lane add whatever the material is
+void Camera::rasterizeTriangle(int index, FragmentCount& count, const RasterTarget& target) {
+	const tri& t = target.triangles[index];
+	const ver *a = &target.vertices[t(0)], *b = &target.vertices[t(1)], *c = &target.vertices[t(2)];
 	//make rasterizing compatible with front culling
 	if (isBackCulling == false) swap(b, c);
-	int left = min(a.position(0), min(b.position(0), c.position(0))),
-		right = max(a.position(0), max(b.position(0), c.position(0))),
-		top = max(a.position(1), max(b.position(1), c.position(1))),
-		down = ceil(min(a.position(1), min(b.position(1), c.position(1))));
-	//2D clipping
-	left = max(0, left); right = min(screenWidth - 1, right);
-	top = min(screenHeight - 1, top); down = max(0, down);
-	vec2 d[3] = { (b.position - a.position).head(2),
-					(c.position - b.position).head(2),
-					(a.position - c.position).head(2) };
-	ver v(vec3(left, down, 0)), vBase, vUp, vRight;
-	long long l, r; //prevents calculation overflow error
+	const vec4* pos[3] = { &a->position, &b->position, &c->position };
+	float extent = 0.0f;
+	for (int i = 0;i < 3;++i) {
+		extent = max(extent, max(std::abs((*pos[i])(0)), std::abs((*pos[i])(1))));
+	}
+	if (extent >= _FIXED_LIMIT) return; //far out of any screen
+	int bits = _SUBPIXEL_BITS;
+	while (bits > 0 && extent * (1 << bits) >= _FIXED_LIMIT) --bits;
+	long long fx[3], fy[3];
+	for (int i = 0;i < 3;++i) {
+		fx[i] = llround((*pos[i])(0) * (1 << bits));
+		fy[i] = llround((*pos[i])(1) * (1 << bits));
+	}
+	//2x area in fixed point, the snapped triangle decides coverage
+	if ((fx[1] - fx[0]) * (fy[2] - fy[0]) - (fy[1] - fy[0]) * (fx[2] - fx[0]) <= 0) return;
+
+	int left = floor(min(a->position(0), min(b->position(0), c->position(0)))),
+		right = ceil(max(a->position(0), max(b->position(0), c->position(0)))),
+		top = ceil(max(a->position(1), max(b->position(1), c->position(1)))),
+		down = floor(min(a->position(1), min(b->position(1), c->position(1))));
+	//2D clipping by the scissor or the tile
+	left = max(target.left, left); right = min(target.right, right);
+	top = min(target.top, top); down = max(target.down, down);
+	if (left > right || down > top) return;
+	//triangles of dense meshes cover a pixel or none, their at most 2x2 pixels are
+	//tested directly, so that the empty ones are gone before any attribute setup
+	bool small = right - left <= 1 && top - down <= 1;
+	int mask = 0; //bit (y - down) * 2 + x - left for covered pixels
+	FixedEdge edges[3];
+	if (small) {
+		for (int y = down;y <= top;++y) {
+			for (int x = left;x <= right;++x) {
+				int i = 0;
+				for (;i < 3;++i) {
+					int j = (i + 1) % 3;
+					if (_edgeFunction(fx[i], fy[i], fx[j], fy[j], x, y, bits) < 0) break;
+				}
+				if (i == 3) mask |= 1 << ((y - down) * 2 + x - left);
+			}
+		}
+		if (!mask) return;
+	} else {
+		for (int i = 0;i < 3;++i) {
+			int j = (i + 1) % 3;
+			edges[i].setup(fx[i], fy[i], fx[j], fy[j], left, down, bits);
+		}
+	}
+
+	//attribute planes stay in float
+	vec2 d[3] = { (b->position - a->position).head(2),
+					(c->position - b->position).head(2),
+					(a->position - c->position).head(2) };
+	vec2 p(left, down);
+	long long l, r;
 	float f[3], temp = -_cross(d[0], d[2]), pz; //2x area of triangle
 	if ((temp <= 0)) return;
 	//pre-computing
-	f[0] = _cross(d[0], (v.position - a.position).head(2));
-	f[1] = _cross(d[1], (v.position - b.position).head(2));
-	f[2] = _cross(d[2], (v.position - c.position).head(2));
-	// Perspective-Correct Interpolation
-	if (isPerspective) {
-		pz = a.position(3); a *= pz; a.position(3) = pz;
-		pz = b.position(3); b *= pz; b.position(3) = pz;
-		pz = c.position(3); c *= pz; c.position(3) = pz;
-	}
-	vBase = (c * f[0] + a * f[1] + b * f[2]) / temp;
-	vUp = (c * d[0](0) + a * d[1](0) + b * d[2](0)) / temp;
-	vRight = (c * d[0](1) + a * d[1](1) + b * d[2](1)) / -temp;
+	f[0] = _cross(d[0], p - a->position.head(2));
+	f[1] = _cross(d[1], p - b->position.head(2));
+	f[2] = _cross(d[2], p - c->position.head(2));
+
+	//the material is the same over the triangle
+	InterpolationPlan plan = renderMode == DEPTH || rasterPhase == RASTER_DEPTH || visBuffer ? PLAN_DEPTH
+		: a->texIndex != -1 ? PLAN_TEXTURE : PLAN_COLOR;
+	int texIndex = a->texIndex;
+	bool receiveShadow = a->receiveShadow;
+	lanef la, lb, lc, v, vBase, vUp, vRight;
+	_toLanes(*a, plan, isPerspective, la);
+	_toLanes(*b, plan, isPerspective, lb);
+	_toLanes(*c, plan, isPerspective, lc);
+	vBase = (lc * f[0] + la * f[1] + lb * f[2]) / temp;
+	vUp = (lc * d[0](0) + la * d[1](0) + lb * d[2](0)) / temp;
+	vRight = (lc * d[0](1) + la * d[1](1) + lb * d[2](1)) / -temp;
 	float *depthptr;
 	ver* fragptr;
+	int* ownerptr;
+	unsigned char* stencilptr;
+	unsigned short* heatptr;
 	//Rasterizating
 	for (int y = down;y <= top;++y) {
-		l = 0; r = right - left;
-
-		for (int i = 0;i < 3;++i) {
-			temp = d[i](1) == 0 ? -screenWidth * (f[i] >= 0) : f[i] / d[i](1);
-			f[i] += d[i](0);
-			-d[i](1) < 0 ? r = min(r, temp) : l = max(l, ceil(temp));
+		if (small) {
+			//covered pixels of a row of the quad are always a span
+			int row = mask >> (y - down) * 2;
+			l = row & 1 ? 0 : 1;
+			r = row & 2 ? 1 : 0;
+		} else {
+			l = 0; r = right - left;
+			edges[0].step(l, r);
+			edges[1].step(l, r);
+			edges[2].step(l, r);
 		}
 
-		if (l <= r) {
+		if (l <= r && visBuffer) {
+			__rasterizeVisibility(y, l + left, r + left, vBase + vRight * l, vRight, index, count);
+		} else if (l <= r) {
 			v = vBase + vRight * l;
 			l += left; r += left;
-			depthptr = &depthBuffer[y][l];
-			fragptr = &frags[y][l];
-
-			for (depthLock[y].lock();l <= r;++l) { //start rasterizing and do early-z
-				pz = v.position(3);
-				if (isPerspective) pz = 1.0f / pz;
-				if (pz < *depthptr) {
-					(*depthptr) = pz;
-					if (this->renderMode != DEPTH) {
-						if (!isPerspective) { (*fragptr) = v; }
-						else { (*fragptr) = v * pz; }
+			depthptr = target.depth + (y - target.y0) * target.stride + l - target.x0;
+			fragptr = target.frags + (y - target.y0) * target.stride + l - target.x0;
+			//owners are only kept while the pre-pass runs
+			ownerptr = target.owners && rasterPhase != RASTER_FULL
+				? target.owners + (y - target.y0) * target.stride + l - target.x0 : nullptr;
+			stencilptr = stencilEnabled ? stencilBuffer + y * screenWidth + l : nullptr;
+			heatptr = heatBuffer ? heatBuffer + (y * screenWidth + l) * 2 : nullptr;
+
+			//contended rows show up in the profiler
+			if (target.locked && !depthLock[y].try_lock()) {
+				ProfileZone zone("depth lock", name);
+				depthLock[y].lock();
+			}
+			if (target.lazyClear) __clearSpan(y, l, r);
+			if (rasterPhase == RASTER_ATTRIBUTE) {
+				//the depth is final, only the nearest fragment gets its payload,
+				//ties of equal depth go to the smallest triangle id whatever the order
+				for (;l <= r;++l) {
+					pz = v(0);
+					if (isPerspective) pz = 1.0f / pz;
+					if (pz <= *depthptr && index < *ownerptr && (!stencilptr || *stencilptr)) {
+						*ownerptr = index;
+						_writeFragment(fragptr, v, pz, plan, isPerspective, texIndex, receiveShadow);
+					}
+					v += vRight;
+					++depthptr;
+					++fragptr;
+					++ownerptr;
+					if (stencilptr) ++stencilptr;
+				}
+			} else {
+				count.tested += _testedCount(stencilptr, r - l + 1);
+				for (;l <= r;++l) { //start rasterizing and do early-z
+					pz = v(0);
+					if (isPerspective) pz = 1.0f / pz;
+					if (heatptr && (!stencilptr || *stencilptr)) ++heatptr[0];
+					if (pz < *depthptr && (!stencilptr || *stencilptr)) {
+						if (*depthptr < 0x505050) ++count.overwritten;
+						++count.passed;
+						if (heatptr) ++heatptr[1];
+						(*depthptr) = pz;
+						if (ownerptr) *ownerptr = INT_MAX; //no payload for the new depth yet
+						//fragment positions are rebuilt from the depth, never stored
+						if (plan != PLAN_DEPTH) {
+							_writeFragment(fragptr, v, pz, plan, isPerspective, texIndex, receiveShadow);
+						}
 					}
+					v += vRight;
+					++depthptr;
+					++fragptr;
+					if (ownerptr) ++ownerptr;
+					if (stencilptr) ++stencilptr;
+					if (heatptr) heatptr += 2;
 				}
-				v += vRight;
-				++depthptr;
-				++fragptr;
 			}
-			depthLock[y].unlock();
+			if (target.locked) depthLock[y].unlock();
 		}
 		vBase += vUp;
 	}
 }
 
-//clip code: y -y x -x
-int Camera::clipcode2d(const vec2& v) {
-	int ret = 0;
-	if (v(0) < 0.0f) ret |= 1;
-	if (v(0) >= screenWidth) ret |= 2;
-	if (v(1) < 0.0f) ret |= 4;
-	if (v(1) >= screenHeight) ret |= 8;
-	return ret;
+bool Camera::__clippedBounds(const tri& t, int& left, int& down, int& right, int& top) {
+	const vec4 &a = vBuffer[t(0)].position, &b = vBuffer[t(1)].position, &c = vBuffer[t(2)].position;
+	left = max(float(scissorLeft), floor(min(a(0), min(b(0), c(0)))));
+	right = min(float(scissorRight), ceil(max(a(0), max(b(0), c(0)))));
+	down = max(float(scissorDown), floor(min(a(1), min(b(1), c(1)))));
+	top = min(float(scissorTop), ceil(max(a(1), max(b(1), c(1)))));
+	return left <= right && down <= top;
+}
+
+//the depth of a cluster is its nearest vertex, quantized to 16 bits over the range of the frame
+//and sorted by two counting passes of a byte each, the sort is stable
+void Camera::__sortTriangles() {
+	ProfileZone zone("sort", name);
+	int size = tBuffer.size(), clusters = (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+	if (clusters < 2) return;
+	vector<float> depth(clusters);
+	float nearest = FLT_MAX, farthest = -FLT_MAX;
+	for (int c = 0;c < clusters;++c) {
+		float z = FLT_MAX;
+		for (int i = c * CLUSTER_SIZE;i < min(size, (c + 1) * CLUSTER_SIZE);++i) {
+			for (int k = 0;k < 3;++k) {
+				//the same depth as the depth test
+				float w = vBuffer[tBuffer[i](k)].position(3);
+				z = min(z, isPerspective ? 1.0f / w : w);
+			}
+		}
+		depth[c] = z;
+		nearest = min(nearest, z);
+		farthest = max(farthest, z);
+	}
+	float scale = 65535.0f / max(farthest - nearest, 1e-6f);
+	sortKeys.resize(clusters);
+	sortOrder.resize(clusters);
+	sortTemp.resize(clusters);
+	for (int c = 0;c < clusters;++c) {
+		sortKeys[c] = (unsigned short)((depth[c] - nearest) * scale);
+		sortOrder[c] = c;
+	}
+
+	int counts[256];
+	for (int shift = 0;shift < 16;shift += 8) {
+		memset(counts, 0, sizeof(counts));
+		for (int c = 0;c < clusters;++c) ++counts[(sortKeys[sortOrder[c]] >> shift) & 0xff];
+		for (int b = 0, sum = 0;b < 256;++b) {
+			int count = counts[b];
+			counts[b] = sum;
+			sum += count;
+		}
+		for (int c = 0;c < clusters;++c) {
+			sortTemp[counts[(sortKeys[sortOrder[c]] >> shift) & 0xff]++] = sortOrder[c];
+		}
+		sortOrder.swap(sortTemp);
+	}
+
+	sortedTBuffer.clear();
+	for (int c = 0;c < clusters;++c) {
+		int first = sortOrder[c] * CLUSTER_SIZE;
+		sortedTBuffer.insert(sortedTBuffer.end(), tBuffer.begin() + first,
+			tBuffer.begin() + min(size, first + CLUSTER_SIZE));
+	}
+	tBuffer.swap(sortedTBuffer);
+}
+
+//occluders are the large front faces in front of the near plane and within the guard band,
+//a block keeps the farthest depth of an occluder only if the occluder covers all of it,
+//blocks are tested LANE_SIZE at a time
+void Camera::__rasterizeOccluders() {
+	ProfileZone zone("occluders", name);
+	coarseX = (viewportWidth + COARSE_BLOCK - 1) / COARSE_BLOCK;
+	coarseY = (viewportHeight + COARSE_BLOCK - 1) / COARSE_BLOCK;
+	//a row is padded, so that the lanes past its last block are still in it
+	coarseStride = (coarseX + LANE_SIZE - 1) / LANE_SIZE * LANE_SIZE + LANE_SIZE;
+	coarseDepth.assign(coarseStride * coarseY, FLT_MAX);
+
+	//block corners are a whole block apart, which covers pixel centers either way
+	const float span = float(COARSE_BLOCK);
+	const lanef steps = lanef::LinSpaced(0.0f, float(LANE_SIZE - 1));
+	float ea[3], eb[3], ec[3];
+	for (std::vector<tri>::const_iterator it = ts->begin();it != ts->end();++it) {
+		const tri& t = *it;
+		if ((clipCodes[t(0)] | clipCodes[t(1)] | clipCodes[t(2)]) & (16 | 32 | 64)) continue;
+		if (!(isBackCulling xor isBackward(t))) continue;
+		const vec4* p[3] = { &vBuffer[t(0)].position, &vBuffer[t(1)].position, &vBuffer[t(2)].position };
+		float minX = min(p[0]->x(), min(p[1]->x(), p[2]->x())),
+			maxX = max(p[0]->x(), max(p[1]->x(), p[2]->x())),
+			minY = min(p[0]->y(), min(p[1]->y(), p[2]->y())),
+			maxY = max(p[0]->y(), max(p[1]->y(), p[2]->y()));
+		//edge values lose precision far off the screen
+		if (minX < -viewportWidth || maxX > 2 * viewportWidth
+			|| minY < -viewportHeight || maxY > 2 * viewportHeight) continue;
+		float area = (p[1]->x() - p[0]->x()) * (p[2]->y() - p[0]->y())
+			- (p[1]->y() - p[0]->y()) * (p[2]->x() - p[0]->x());
+		if (abs(area) < OCCLUDER_MIN_AREA) continue;
+		if (area < 0.0f) {
+			swap(p[1], p[2]);
+			area = -area;
+		}
+
+		//edge i goes from vertex i to the next one and is positive inside,
+		//it weights the vertex opposite to it in the plane of lane 0
+		float da = 0.0f, db = 0.0f, dc = 0.0f;
+		for (int i = 0;i < 3;++i) {
+			const vec4 &u = *p[i], &v = *p[(i + 1) % 3];
+			ea[i] = u(1) - v(1);
+			eb[i] = v(0) - u(0);
+			ec[i] = -(ea[i] * u(0) + eb[i] * u(1));
+			float w = (*p[(i + 2) % 3])(3) / area;
+			da += ea[i] * w;
+			db += eb[i] * w;
+			dc += ec[i] * w;
+		}
+
+		int left = int(max(0.0f, minX)) / COARSE_BLOCK, right = min(coarseX - 1, int(max(0.0f, maxX)) / COARSE_BLOCK),
+			down = int(max(0.0f, minY)) / COARSE_BLOCK, top = min(coarseY - 1, int(max(0.0f, maxY)) / COARSE_BLOCK);
+		for (int by = down;by <= top;++by) {
+			float y = float(by * COARSE_BLOCK);
+			float* row = coarseDepth.data() + by * coarseStride;
+			for (int bx = left;bx <= right;bx += LANE_SIZE) {
+				lanef blocks = steps + float(bx);
+				lanef x = blocks * span;
+				laneb inside = blocks <= float(right);
+				//the least edge value over the corners of a block
+				for (int i = 0;i < 3;++i) {
+					float offset = eb[i] * y + ec[i] + min(0.0f, ea[i] * span) + min(0.0f, eb[i] * span);
+					inside = inside && (ea[i] * x + offset >= 0.0f);
+				}
+				//1 / w is farthest where it is the least
+				lanef depth;
+				if (isPerspective) {
+					depth = da * x + (db * y + dc + min(0.0f, da * span) + min(0.0f, db * span));
+					inside = inside && depth > 0.0f;
+					depth = depth.inverse();
+				} else {
+					depth = da * x + (db * y + dc + max(0.0f, da * span) + max(0.0f, db * span));
+				}
+				Map<lanef> blockDepth(row + bx);
+				blockDepth = inside.select(blockDepth.min(depth), blockDepth);
+			}
+		}
+	}
+}
+
+//the nearest vertex of a cluster against every block its bounding rectangle touches,
+//vertices off the near plane or the clip plane have no screen position to test
+bool Camera::__isClusterOccluded(int first, int last) {
+	float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX, nearest = FLT_MAX;
+	for (int i = first;i < last;++i) {
+		for (int k = 0;k < 3;++k) {
+			int index = (*ts)[i](k);
+			if (clipCodes[index] & (16 | 64)) return false;
+			const vec4& p = vBuffer[index].position;
+			minX = min(minX, p(0));
+			maxX = max(maxX, p(0));
+			minY = min(minY, p(1));
+			maxY = max(maxY, p(1));
+			nearest = min(nearest, isPerspective ? 1.0f / p(3) : p(3));
+		}
+	}
+	//clamped to the buffer, blocks on its border stand for the pixels beyond
+	float width = float(coarseX * COARSE_BLOCK - 1), height = float(coarseY * COARSE_BLOCK - 1);
+	int left = int(min(width, max(0.0f, floor(minX)))) / COARSE_BLOCK,
+		right = int(min(width, max(0.0f, ceil(maxX)))) / COARSE_BLOCK,
+		down = int(min(height, max(0.0f, floor(minY)))) / COARSE_BLOCK,
+		top = int(min(height, max(0.0f, ceil(maxY)))) / COARSE_BLOCK;
+	for (int by = down;by <= top;++by) {
+		const float* row = coarseDepth.data() + by * coarseStride;
+		for (int bx = left;bx <= right;++bx) {
+			if (nearest <= row[bx] * (1.0f + OCCLUSION_DEPTH_BIAS)) return false;
+		}
+	}
+	return true;
+}
+
+//the depth of the frame is reduced to the farthest of every block and tested like the occluders,
+//a cluster is seen unless it is all out of one plane of the view or behind that depth
+void Camera::__recordVisibleClusters() {
+	ProfileZone zone("record", name);
+	coarseX = (viewportWidth + COARSE_BLOCK - 1) / COARSE_BLOCK;
+	coarseY = (viewportHeight + COARSE_BLOCK - 1) / COARSE_BLOCK;
+	coarseStride = (coarseX + LANE_SIZE - 1) / LANE_SIZE * LANE_SIZE + LANE_SIZE;
+	coarseDepth.assign(coarseStride * coarseY, -FLT_MAX);
+	for (int y = 0;y < viewportHeight;++y) {
+		float* row = coarseDepth.data() + y / COARSE_BLOCK * coarseStride;
+		for (int x = 0;x < viewportWidth;++x) {
+			float& depth = row[x / COARSE_BLOCK];
+			depth = max(depth, getDepth(x, y));
+		}
+	}
+
+	int triangles = ts->size();
+	for (int first = 0;first < triangles;first += CLUSTER_SIZE) {
+		int cluster = first / CLUSTER_SIZE, last = min(triangles, first + CLUSTER_SIZE);
+		unsigned char& bits = clusterRecord[cluster >> 3];
+		if (bits & (1 << (cluster & 7))) continue;
+		int outside = 0xff;
+		for (int i = first;i < last;++i) {
+			const tri& t = (*ts)[i];
+			outside &= clipCodes[t(0)] & clipCodes[t(1)] & clipCodes[t(2)];
+		}
+		if (!outside && !__isClusterOccluded(first, last)) {
+			bits |= 1 << (cluster & 7);
+		}
+	}
+}
+
+//the cost of a triangle is estimated by its clipped bounding rectangle, small triangles
+//are batched until a job is worth RASTER_JOB_COST and large ones are split into bands
+void Camera::__scheduleRaster() {
+	ProfileZone zone("schedule", name);
+	rasterIds.clear();
+	rasterJobs.clear();
+	int faces = 0, cost = 0, first = 0, size = tBuffer.size();
+	for (int i = 0;i < size;++i) {
+		if (!(isBackCulling xor isBackward(tBuffer[i]))) continue;
+		++faces;
+		int left, down, right, top;
+		if (!__clippedBounds(tBuffer[i], left, down, right, top)) continue;
+		int width = right - left + 1;
+		if (width * (top - down + 1) > RASTER_JOB_COST) {
+			//close the open batch, so that it doesn't cover this triangle
+			if (first < int(rasterIds.size())) {
+				rasterJobs.push_back({ first, int(rasterIds.size()), scissorDown, scissorTop });
+			}
+			int band = max(1, RASTER_JOB_COST / width);
+			for (int y = down;y <= top;y += band) {
+				rasterJobs.push_back({ int(rasterIds.size()), int(rasterIds.size()) + 1, y, min(top, y + band - 1) });
+			}
+			rasterIds.push_back(i);
+			first = rasterIds.size();
+			cost = 0;
+			continue;
+		}
+		rasterIds.push_back(i);
+		cost += width * (top - down + 1) + TRIANGLE_SETUP_COST;
+		if (cost >= RASTER_JOB_COST) {
+			rasterJobs.push_back({ first, int(rasterIds.size()), scissorDown, scissorTop });
+			first = rasterIds.size();
+			cost = 0;
+		}
+	}
+	if (first < int(rasterIds.size())) {
+		rasterJobs.push_back({ first, int(rasterIds.size()), scissorDown, scissorTop });
+	}
+	renderingFace.store(faces);
+}
+
+//triangles are added to every tile their bounding rectangle overlaps
+void Camera::__binTriangles() {
+	ProfileZone zone("bin", name);
+	tilesX = (viewportWidth + TILE_WIDTH - 1) / TILE_WIDTH;
+	tilesY = (viewportHeight + TILE_HEIGHT - 1) / TILE_HEIGHT;
+	if (int(tileBins.size()) < tilesX * tilesY) tileBins.resize(tilesX * tilesY);
+	for (int i = 0;i < tilesX * tilesY;++i) tileBins[i].clear();
+
+	int faces = 0, size = tBuffer.size();
+	for (int i = 0;i < size;++i) {
+		if (!(isBackCulling xor isBackward(tBuffer[i]))) continue;
+		++faces;
+		int left, down, right, top;
+		if (!__clippedBounds(tBuffer[i], left, down, right, top)) continue;
+		for (int ty = down / TILE_HEIGHT;ty <= top / TILE_HEIGHT;++ty) {
+			for (int tx = left / TILE_WIDTH;tx <= right / TILE_WIDTH;++tx) {
+				tileBins[ty * tilesX + tx].push_back(i);
+			}
+		}
+	}
+
+	frameStat.renderingFaces = faces;
+	frameStat.trianglesCulled = size - faces;
+	fragmentTested.store(0);
+	fragmentPassed.store(0);
+	fragmentOverwritten.store(0);
+	nextTile.store(0);
+}
+
+static const unsigned long long _VISIBILITY_EMPTY = ~0ULL;
+
+//positive floats keep their order as unsigned ints
+static inline unsigned long long _visibilityKey(float depth, int index) {
+	unsigned int bits;
+	memcpy(&bits, &depth, sizeof(bits));
+	return (unsigned long long)bits << 32 | (unsigned int)index;
+}
+
+void Camera::__rasterizeVisibility(int y, int l, int r, const lanef& vStart, const lanef& vRight,
+	int index, FragmentCount& count) {
+	atomic<unsigned long long>* visptr = visBuffer + y * screenWidth + l;
+	unsigned char* stencilptr = stencilEnabled ? stencilBuffer + y * screenWidth + l : nullptr;
+	unsigned short* heatptr = heatBuffer ? heatBuffer + (y * screenWidth + l) * 2 : nullptr;
+	unsigned long long key, old;
+	lanef v = vStart;
+	float pz;
+	if (heatptr) depthLock[y].lock(); //heat counters are not atomic
+	count.tested += _testedCount(stencilptr, r - l + 1);
+	for (;l <= r;++l) {
+		pz = v(0);
+		if (isPerspective) pz = 1.0f / pz;
+		if (!stencilptr || *stencilptr) {
+			if (heatptr) ++heatptr[0];
+			key = _visibilityKey(pz, index);
+			old = visptr->load(memory_order_relaxed);
+			while (key < old && !visptr->compare_exchange_weak(old, key, memory_order_relaxed));
+			if (key < old) { //old is what has been replaced
+				if (old != _VISIBILITY_EMPTY) ++count.overwritten;
+				++count.passed;
+				if (heatptr) ++heatptr[1];
+			}
+		}
+		v += vRight;
+		++visptr;
+		if (stencilptr) ++stencilptr;
+		if (heatptr) heatptr += 2;
+	}
+	if (heatptr) depthLock[y].unlock();
 }
 
-//return whether the line is retained
-bool Camera::lineClip(vec2& a, vec2& b) {
-	int codea = clipcode2d(a), codeb = clipcode2d(b),
-		code = codea | codeb;
-	//all out of screen
-	if (codea & codeb) return false;
-	//all in the screen
-	if (!code) return true;
-	//to be done
-	;
+//the attribute planes are set up once per triangle and reused along the row
+bool Camera::__resolveVisibility(unsigned long long key, int x, int y,
+	VisibleTriangle& visible, float& depth, ver& frag) {
+	if (key == _VISIBILITY_EMPTY) return false;
+	int id = int(key & 0xffffffff);
+	if (id != visible.id) {
+		const tri& t = shadingTBuffer[id];
+		const ver &a = shadingVBuffer[t(0)], &b = shadingVBuffer[t(1)], &c = shadingVBuffer[t(2)];
+		InterpolationPlan plan = a.texIndex != -1 ? PLAN_TEXTURE : PLAN_COLOR;
+		lanef la, lb, lc;
+		_toLanes(a, plan, isPerspective, la);
+		_toLanes(b, plan, isPerspective, lb);
+		_toLanes(c, plan, isPerspective, lc);
+		vec2 d1 = (b.position - a.position).head(2), d2 = (c.position - a.position).head(2);
+		float area = _cross(d1, d2);
+		if (area == 0.0f) return false;
+		visible.base = la;
+		visible.dx = ((lb - la) * d2(1) - (lc - la) * d1(1)) / area;
+		visible.dy = ((lc - la) * d1(0) - (lb - la) * d2(0)) / area;
+		visible.x0 = a.position(0);
+		visible.y0 = a.position(1);
+		visible.id = id;
+		visible.plan = plan;
+		visible.texIndex = a.texIndex;
+		visible.receiveShadow = a.receiveShadow;
+	}
+	unsigned int bits = (unsigned int)(key >> 32);
+	memcpy(&depth, &bits, sizeof(depth));
+	_writeFragment(&frag, visible.base + visible.dx * (x - visible.x0) + visible.dy * (y - visible.y0),
+		depth, InterpolationPlan(visible.plan), isPerspective, visible.texIndex, visible.receiveShadow);
 	return true;
 }
 
-//no 2D clipping, so it might costs while drawing out of screen
-void Camera::drawLine(const ver& a, const ver& b) {
-	vec2 pa(a.position.head(2)), pb(b.position.head(2));
-	lineClip(pa, pb);
-	float dx = pb(0) - pa(0),
-		dy = pb(1) - pa(1),
-		x = pa(0), y = pa(1), k;
-	k = max(abs(dx), abs(dy)); //line slope
-	dx /= k; dy /= k;
+//stencil triangles are rasterized into the stencil buffer,
+//and their bounding rectangle becomes the scissor of this frame
+void Camera::__buildStencil() {
+	if (!stencilBuffer) stencilBuffer = new unsigned char[screenWidth * screenHeight];
+	float minx = viewportWidth, miny = viewportHeight, maxx = -1.0f, maxy = -1.0f;
+	for (auto it = stencilTriangles->begin();it != stencilTriangles->end();++it) {
+		for (int i = 0;i < 3;++i) {
+			const vec4& p = vBuffer[(*it)(i)].position;
+			minx = min(minx, p(0)); maxx = max(maxx, p(0));
+			miny = min(miny, p(1)); maxy = max(maxy, p(1));
+		}
+	}
+	//one more pixel around, the reflaction texture is sampled a bit off the pixel
+	scissorLeft = int(max(0.0f, floor(minx) - 1.0f));
+	scissorRight = int(min(viewportWidth - 1.0f, ceil(maxx) + 1.0f));
+	scissorDown = int(max(0.0f, floor(miny) - 1.0f));
+	scissorTop = int(min(viewportHeight - 1.0f, ceil(maxy) + 1.0f));
+	stencilEnabled = true;
+	if (scissorLeft > scissorRight) return; //out of screen
+
+	for (int y = scissorDown;y <= scissorTop;++y) {
+		memset(stencilBuffer + y * screenWidth + scissorLeft, 0, scissorRight - scissorLeft + 1);
+	}
+	for (auto it = stencilTriangles->begin();it != stencilTriangles->end();++it) {
+		__rasterizeStencil(*it);
+	}
+}
 
-	int tick = int(k); //count of line pixels in screen space
-	int ix, iy;
-	for (int i = 0;i <= tick + 1;++i) { //draw tick+1 times
-		ix = int(x), iy = int(y);
-		if ((ix | iy) >= 0 && ix < screenWidth && iy < screenHeight) {
-			frags[iy][ix].color << 200, 200, 200;
+//coverage only, both windings are accepted and edges are widened by a pixel
+void Camera::__rasterizeStencil(const tri& t) {
+	vec2 p[3] = { vBuffer[t(0)].position.head(2),
+					vBuffer[t(1)].position.head(2),
+					vBuffer[t(2)].position.head(2) };
+	vec2 d[3] = { p[1] - p[0], p[2] - p[1], p[0] - p[2] };
+	float area = _cross(d[0], -d[2]), margin[3];
+	if (area == 0.0f) return;
+	for (int i = 0;i < 3;++i) {
+		margin[i] = -1.5f * d[i].norm();
+		if (area < 0.0f) d[i] = -d[i]; //flip edge functions of clockwise triangles
+	}
+	int left = int(max(float(scissorLeft), floor(min(p[0](0), min(p[1](0), p[2](0)))) - 1.0f)),
+		right = int(min(float(scissorRight), ceil(max(p[0](0), max(p[1](0), p[2](0)))) + 1.0f)),
+		down = int(max(float(scissorDown), floor(min(p[0](1), min(p[1](1), p[2](1)))) - 1.0f)),
+		top = int(min(float(scissorTop), ceil(max(p[0](1), max(p[1](1), p[2](1)))) + 1.0f));
+	for (int y = down;y <= top;++y) {
+		unsigned char* sptr = stencilBuffer + y * screenWidth;
+		for (int x = left;x <= right;++x) {
+			vec2 q(x, y);
+			if (_cross(d[0], q - p[0]) >= margin[0]
+				&& _cross(d[1], q - p[1]) >= margin[1]
+				&& _cross(d[2], q - p[2]) >= margin[2]) {
+				sptr[x] = 1;
+			}
+		}
+	}
+}
+
+//edges are keyed by their vertices, the smaller first, then sorted to drop the shared ones
+void Camera::__buildEdges() {
+	if (!edgesDirty) return;
+	ProfileZone zone("build edges", name);
+	vector<unsigned long long> keys;
+	keys.reserve(ts->size() * 3);
+	for (auto it = ts->begin();it != ts->end();++it) {
+		for (int k = 0;k < 3;++k) {
+			unsigned int a = (*it)(k), b = (*it)((k + 1) % 3);
+			if (a > b) swap(a, b);
+			keys.push_back((unsigned long long)a << 32 | b);
 		}
-		x += dx; y += dy;
 	}
+	sort(keys.begin(), keys.end());
+	keys.erase(unique(keys.begin(), keys.end()), keys.end());
+	meshEdges.clear();
+	meshEdges.reserve(keys.size());
+	for (auto it = keys.begin();it != keys.end();++it) {
+		meshEdges.emplace_back(int(*it >> 32), int(*it & 0xffffffff));
+	}
+	edgesDirty = false;
 }
 
-void Camera::wireframeTriangle(const tri& t) {
-	drawLine(vBuffer[t(0)], vBuffer[t(1)]);
-	drawLine(vBuffer[t(1)], vBuffer[t(2)]);
-	drawLine(vBuffer[t(0)], vBuffer[t(2)]);
+//edges out of a single clipping plane are dropped and the ones crossing the
+//near plane are cut there, the rest is clipped in screen space while drawing
+void Camera::__clipLines() {
+	__buildEdges();
+	lineBuffer.clear();
+	for (auto it = meshEdges.begin();it != meshEdges.end();++it) {
+		int codea = clipCodes[it->first], codeb = clipCodes[it->second];
+		if (codea & codeb) continue;
+		if ((codea | codeb) & 16) {
+			//in clip space, the inside end keeps its screen position
+			int inside = codea & 16 ? it->second : it->first;
+			ver v(vBuffer[codea & 16 ? it->first : it->second]), in(vBuffer[inside]);
+			__clipSpacePosition(codea & 16 ? it->first : it->second, v.position);
+			__clipSpacePosition(inside, in.position);
+			nearClip(v, in);
+			vBuffer.emplace_back(v);
+			lineBuffer.emplace_back(inside, int(vBuffer.size()) - 1);
+		} else {
+			lineBuffer.push_back(*it);
+		}
+	}
+}
+
+//lines are sorted into bands of rows by counting, every band is a job even
+//without lines, since its rows are cleared and presented by the job
+void Camera::__binLines() {
+	ProfileZone zone("bin lines", name);
+	int bands = (viewportHeight + LINE_BAND_HEIGHT - 1) / LINE_BAND_HEIGHT, size = lineBuffer.size();
+	vector<int> first(bands + 1, 0), lineBands(size * 2, -1);
+	for (int i = 0;i < size;++i) {
+		const vec4 &a = vBuffer[lineBuffer[i].first].position, &b = vBuffer[lineBuffer[i].second].position;
+		float down = min(a(1), b(1)), top = max(a(1), b(1));
+		if (top < -0.5f || down > viewportHeight - 0.5f) continue;
+		if (max(a(0), b(0)) < -0.5f || min(a(0), b(0)) > viewportWidth - 0.5f) continue;
+		//rows are the rounded minor coordinates
+		lineBands[i * 2] = max(0, int(floor(down + 0.5f))) / LINE_BAND_HEIGHT;
+		lineBands[i * 2 + 1] = min(viewportHeight - 1, int(floor(top + 0.5f))) / LINE_BAND_HEIGHT;
+		for (int band = lineBands[i * 2];band <= lineBands[i * 2 + 1];++band) ++first[band + 1];
+	}
+	for (int band = 0;band < bands;++band) first[band + 1] += first[band];
+
+	rasterIds.resize(first[bands]);
+	rasterJobs.clear();
+	for (int band = 0;band < bands;++band) {
+		rasterJobs.push_back({ first[band], first[band + 1], band * LINE_BAND_HEIGHT,
+			min(viewportHeight - 1, (band + 1) * LINE_BAND_HEIGHT - 1) });
+	}
+	for (int i = 0;i < size;++i) {
+		if (lineBands[i * 2] < 0) continue;
+		for (int band = lineBands[i * 2];band <= lineBands[i * 2 + 1];++band) {
+			rasterIds[first[band]++] = i;
+		}
+	}
+}
+
+void Camera::__drawLineBand(const RasterJob& job) {
+	for (int y = job.down;y <= job.top;++y) {
+		memset(colorBuffer[y], 0, sizeof(int) * viewportWidth);
+	}
+	for (int k = job.first;k < job.last;++k) {
+		__drawLine(lineBuffer[rasterIds[k]], job.down, job.top);
+	}
+	for (int y = job.down;y <= job.top;++y) {
+		if (floatTarget[0]) { //in the 0..1 range of the shaded rows
+			Color::unpackSpan(colorBuffer[y], floatTarget[0] + y * viewportWidth,
+				floatTarget[1] + y * viewportWidth, floatTarget[2] + y * viewportWidth, viewportWidth);
+		} else if (presentTarget) { //flipping y like the frame threads
+			memcpy(presentTarget + (viewportHeight - 1 - y) * screenWidth, colorBuffer[y], sizeof(int) * viewportWidth);
+		}
+	}
+}
+
+//Liang-Barsky clipping of the parameter range by p * t <= q
+static inline bool _clipLineParam(float p, float q, float& t0, float& t1) {
+	if (p == 0.0f) return q >= 0.0f;
+	float t = q / p;
+	if (p < 0.0f) {
+		if (t > t1) return false;
+		t0 = max(t0, t);
+	} else {
+		if (t < t0) return false;
+		t1 = min(t1, t);
+	}
+	return true;
+}
+
+//a pixel per column or row along the major axis, the minor coordinate is stepped
+//in 16.16 fixed point and rounded, and the depth is stepped like the lane 0 of triangles
+void Camera::__drawLine(const pair<int, int>& line, int down, int top) {
+	const vec4 &a = vBuffer[line.first].position, &b = vBuffer[line.second].position;
+	float dx = b(0) - a(0), dy = b(1) - a(1), t0 = 0.0f, t1 = 1.0f;
+	//the viewport columns and the rows of the band, half a pixel out for the rounding
+	if (!_clipLineParam(-dx, a(0) + 0.5f, t0, t1)
+		|| !_clipLineParam(dx, viewportWidth - 0.5f - a(0), t0, t1)
+		|| !_clipLineParam(-dy, a(1) - down + 0.5f, t0, t1)
+		|| !_clipLineParam(dy, top + 0.5f - a(1), t0, t1)) {
+		return;
+	}
+	bool xMajor = abs(dx) >= abs(dy);
+	float dm = xMajor ? dx : dy, dn = xMajor ? dy : dx;
+	if (dm == 0.0f) return;
+	float m0 = xMajor ? a(0) : a(1), n0 = xMajor ? a(1) : a(0),
+		slope = dn / dm, depthStep = (b(3) - a(3)) / dm;
+	int start = ceil(min(m0 + dm * t0, m0 + dm * t1)),
+		end = floor(max(m0 + dm * t0, m0 + dm * t1));
+	//rows out of the band belong to other threads, whatever the float rounding
+	start = max(start, xMajor ? 0 : down);
+	end = min(end, xMajor ? viewportWidth - 1 : top);
+	int nLimit = xMajor ? top : viewportWidth - 1, nBase = xMajor ? down : 0;
+
+	long long n = llround((n0 + (start - m0) * slope) * 65536.0f) + 32768, nStep = llround(slope * 65536.0f);
+	float depth = a(3) + (start - m0) * depthStep, pz;
+	for (int m = start;m <= end;++m, n += nStep, depth += depthStep) {
+		int minor = int(n >> 16);
+		if (minor < nBase || minor > nLimit) continue;
+		int x = xMajor ? m : minor, y = xMajor ? minor : m;
+		if (hiddenLine) {
+			pz = isPerspective ? 1.0f / depth : depth;
+			if (pz > getDepth(x, y) * (1.0f + LINE_DEPTH_BIAS)) continue;
+		}
+		colorBuffer[y][x] = LINE_COLOR;
+	}
 }
 
 void Camera::rasterizationThread(int tid) {
 	int size;
+	FragmentCount count;
+	RasterTarget target;
+	target.x0 = target.y0 = 0;
+	target.locked = true;
+	Profiler::setThreadName(string(name) + " rasterize " + to_string(tid));
 	while (__rasthreadState[tid] != EXIT) {
+		ProfileZone waitZone("wait", name);
 		unique_lock<mutex> locker(rasmutex);
 		while (!rasReady[tid].load()) {
 			threadRasCon.wait_for(locker, chrono::milliseconds(30));
 		}
+		waitZone.end();
 		//threadCon.wait(locker, [this, tid]() {return rasReady[tid].load();});
 		rasReady[tid].store(false);
 		
 		threadRasCon.notify_one();
 		locker.unlock();
 
-		size = tBuffer.size();
-		for (int i = tid;i < size;i += RASTHREAD_SIZE) {
-			if (isBackCulling xor isBackward(tBuffer[i])) {
-				++renderingFace;
-				if (renderMode == NORMAL || renderMode == DEPTH) {
-					rasterizeTriangle(tBuffer[i]);
-				} else if (renderMode == WIREFRAME) {
-					wireframeTriangle(tBuffer[i]);
-				} else {
-					//error
-				}
+		ProfileZone zone("rasterize", name);
+		count.tested = count.passed = count.overwritten = 0;
+		target.left = scissorLeft; target.right = scissorRight;
+		target.stride = screenWidth;
+		target.lazyClear = clearEpochs != nullptr;
+		target.depth = depthBuffer ? depthBuffer[0] : nullptr;
+		target.frags = frags ? frags[0] : nullptr;
+		target.owners = fragOwners;
+		target.triangles = tBuffer.data();
+		target.vertices = vBuffer.data();
+		size = rasterJobs.size();
+		for (int job = nextRasterJob++;job < size;job = nextRasterJob++) {
+			const RasterJob& j = rasterJobs[job];
+			target.down = j.down; target.top = j.top;
+			if (rasterPhase == RASTER_LINES) {
+				__drawLineBand(j);
+				continue;
+			}
+			for (int k = j.first;k < j.last;++k) {
+				rasterizeTriangle(rasterIds[k], count, target);
 			}
 		}
+		zone.end();
+
+		//depth maps never run the pre-pass, so they don't measure for PREPASS_AUTO
+		if ((rasterPhase == RASTER_FULL || rasterPhase == RASTER_DEPTH)
+			&& (this->isStatEnable || (prePassMode == PREPASS_AUTO && renderMode == NORMAL))) {
+			fragmentTested += count.tested;
+			fragmentPassed += count.passed;
+			fragmentOverwritten += count.overwritten;
+		}
 
 		++rasFinished;
 		if (rasFinished.load() == RASTHREAD_SIZE) {
@@ -594,113 +1782,408 @@ void Camera::rasterizationThread(int tid) {
 	}
 }
 
+//arrays of a frame thread for shading rows span by span
+struct Camera::ShadingScratch {
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+	ShadingScratch(int screenWidth);
+	~ShadingScratch();
+
+	//span arrays are padded so that lights can always work on whole lanes
+	int width;
+	float* data;
+	//unclamped colors of the current row, packed at once when the row is done
+	float *rowR, *rowG, *rowB,
+		//fragment attributes
+		*fx, *fdepth, *px, *py, *pz, *nx, *ny, *nz, *receiveShadow,
+		//fragment colors before lighting
+		*sr, *sg, *sb,
+		//accumulated light colors and intensities
+		*lr, *lg, *lb, *totalInten, *intensity;
+	int* spanX;
+	ShadingSpan span;
+
+	//pixel resolved from the visibility buffer
+	float visibleDepth;
+	ver visibleFrag;
+	VisibleTriangle visible;
+
+	//G-buffer of a tile in tiled rendering, allocated on first use
+	float* tileDepth;
+	ver* tileFrags;
+};
+
+Camera::ShadingScratch::ShadingScratch(int screenWidth) {
+	width = (screenWidth + LANE_SIZE - 1) / LANE_SIZE * LANE_SIZE;
+	data = new float[width * 20]();
+	float** arrays[20] = { &rowR, &rowG, &rowB, &fx, &fdepth, &px, &py, &pz, &nx, &ny, &nz,
+		&receiveShadow, &sr, &sg, &sb, &lr, &lg, &lb, &totalInten, &intensity };
+	for (int i = 0;i < 20;++i) *arrays[i] = data + width * i;
+	spanX = new int[width];
+	span.x = fx; span.depth = fdepth;
+	span.px = px; span.py = py; span.pz = pz;
+	span.nx = nx; span.ny = ny; span.nz = nz;
+	span.receiveShadow = receiveShadow;
+	tileDepth = nullptr;
+	tileFrags = nullptr;
+}
+
+Camera::ShadingScratch::~ShadingScratch() {
+	delete[] data;
+	delete[] spanX;
+	if (tileDepth) delete[] tileDepth;
+	if (tileFrags) delete[] tileFrags;
+}
+
+//shade pixels [left, right] of row y and write them out, dptr and fptr point at
+//the depth and fragment of pixel left, nullptr with the visibility buffer
+//return the count of shaded fragments
+int Camera::__shadeRow(int y, int left, int right, float* dptr, ver* fptr,
+	const unsigned int* epochs, ShadingScratch& s) {
+	UT3D* ut = UT3D::instance();
+	int count = right - left + 1, spanSize = 0, paddedSize, step = 1;
+	vec3 fragColor; //vector formed color
+	float *rowR = s.rowR, *rowG = s.rowG, *rowB = s.rowB;
+	int* cptr = this->colorBuffer[y] + left; //color buffer pointer
+	if (visBuffer) { //the pointers stay on the resolved pixel
+		dptr = &s.visibleDepth;
+		fptr = &s.visibleFrag;
+		step = 0;
+	}
+	memset(rowR + left, 0, sizeof(float) * count);
+	memset(rowG + left, 0, sizeof(float) * count);
+	memset(rowB + left, 0, sizeof(float) * count);
+	for (int x = left;x <= right;++x, ++cptr, dptr += step, fptr += step) {
+		if (epochs && epochs[x / CLEAR_TILE_WIDTH] != clearEpoch) {
+			//nothing was drawn into this clear tile, skip to its last pixel
+			int skip = min(right, (x / CLEAR_TILE_WIDTH + 1) * CLEAR_TILE_WIDTH - 1) - x;
+			x += skip; cptr += skip; dptr += skip; fptr += skip;
+			continue;
+		}
+		if (renderMode == NORMAL) {
+			if (visBuffer && !__resolveVisibility(visBuffer[y * screenWidth + x].load(memory_order_relaxed),
+				x, y, s.visible, s.visibleDepth, s.visibleFrag)) {
+				continue;
+			}
+			if (*dptr >= 0x505050) continue; //not out of max view depth
+			if (fptr->texIndex != -1) { //texid != -1 means texture enabled
+				if (fptr->uv(0) < 0) { //reflaction texture
+					fragColor = Color::toColorVector(
+						ut->textureBuffer[fptr->texIndex].getColor(
+							1.0f * x / viewportWidth,
+							1.0f * y / viewportHeight
+						)
+					);
+				} else {
+					fragColor = Color::toColorVector(
+						ut->textureBuffer[fptr->texIndex].getColor(fptr->uv)
+					);
+				}
+			} else {
+				fragColor = fptr->color;
+			}
+
+			//gather the fragment into the span
+			s.spanX[spanSize] = x;
+			s.fx[spanSize] = x;
+			s.fdepth[spanSize] = *dptr;
+			s.nx[spanSize] = fptr->normal(0);
+			s.ny[spanSize] = fptr->normal(1);
+			s.nz[spanSize] = fptr->normal(2);
+			s.receiveShadow[spanSize] = fptr->receiveShadow ? 1.0f : 0.0f;
+			s.sr[spanSize] = fragColor(0); s.sg[spanSize] = fragColor(1); s.sb[spanSize] = fragColor(2);
+			++spanSize;
+		} else {
+			rowR[x] = fptr->color(0);
+			rowG[x] = fptr->color(1);
+			rowB[x] = fptr->color(2);
+		}
+	}
+
+	if (spanSize) {
+		//lighting computation, one batch per light
+		paddedSize = (spanSize + LANE_SIZE - 1) / LANE_SIZE * LANE_SIZE;
+		s.span.count = paddedSize;
+		//padding fragments have no normal, so they are never lit or shadowed
+		for (int i = spanSize;i < paddedSize;++i) {
+			s.fx[i] = s.fdepth[i] = 0.0f;
+			s.nx[i] = s.ny[i] = s.nz[i] = 0.0f;
+			s.receiveShadow[i] = 0.0f;
+		}
+
+		//transform the fragments from screen space to world space
+		//along the row rays instead of a matrix product per fragment
+		getRowRays(y, _shadingCVVToWorld, s.span.rays);
+		const vec4 &ray = s.span.rays[0], &rayStep = s.span.rays[1],
+			&base = s.span.rays[2], &baseStep = s.span.rays[3];
+		Eigen::Map<Eigen::ArrayXf> ax(s.fx, paddedSize), adepth(s.fdepth, paddedSize);
+		Eigen::Map<Eigen::ArrayXf>(s.px, paddedSize) =
+			adepth * (ray(0) + ax * rayStep(0)) + base(0) + ax * baseStep(0);
+		Eigen::Map<Eigen::ArrayXf>(s.py, paddedSize) =
+			adepth * (ray(1) + ax * rayStep(1)) + base(1) + ax * baseStep(1);
+		Eigen::Map<Eigen::ArrayXf>(s.pz, paddedSize) =
+			adepth * (ray(2) + ax * rayStep(2)) + base(2) + ax * baseStep(2);
+		Eigen::Map<Eigen::ArrayXf> alr(s.lr, paddedSize), alg(s.lg, paddedSize),
+			alb(s.lb, paddedSize), atotal(s.totalInten, paddedSize),
+			aintensity(s.intensity, paddedSize);
+		alr.setZero(); alg.setZero(); alb.setZero(); atotal.setZero();
+		for (auto it = ut->lightings.begin();it != ut->lightings.end();++it) {
+			(*it)->lightSpan(s.span, s.intensity);
+			vec3 lightColor = (*it)->getColor();
+			alr += aintensity * lightColor(0);
+			alg += aintensity * lightColor(1);
+			alb += aintensity * lightColor(2);
+			atotal += aintensity;
+		}
+		//scatter the lit span back into the row, clamped by Color::packSpan() below
+		for (int i = 0;i < spanSize;++i) {
+			rowR[s.spanX[i]] = s.sr[i] * s.totalInten[i] * s.lr[i];
+			rowG[s.spanX[i]] = s.sg[i] * s.totalInten[i] * s.lg[i];
+			rowB[s.spanX[i]] = s.sb[i] * s.totalInten[i] * s.lb[i];
+		}
+	}
+	if (shadingFloatTarget[0]) { //left unclamped for the float target
+		memcpy(shadingFloatTarget[0] + y * viewportWidth + left, rowR + left, sizeof(float) * count);
+		memcpy(shadingFloatTarget[1] + y * viewportWidth + left, rowG + left, sizeof(float) * count);
+		memcpy(shadingFloatTarget[2] + y * viewportWidth + left, rowB + left, sizeof(float) * count);
+		return spanSize;
+	}
+	Color::packSpan(rowR + left, rowG + left, rowB + left, cptr - count, count);
+	//present the finished row while it is still in cache, flipping y on the way
+	if (shadingPresentTarget) {
+		memcpy(shadingPresentTarget + (viewportHeight - 1 - y) * screenWidth + left,
+			cptr - count, sizeof(int) * count);
+	}
+	return spanSize;
+}
+
+//tiles are taken one by one, rasterized into the tile G-buffer and
+//shaded right away while the G-buffer is still in cache
+int Camera::__shadeTiles(ShadingScratch& s, FragmentCount& count) {
+	int tile, shaded = 0, tileCount = tilesX * tilesY;
+	if (!s.tileDepth) {
+		s.tileDepth = new float[TILE_WIDTH * TILE_HEIGHT];
+		s.tileFrags = new ver[TILE_WIDTH * TILE_HEIGHT];
+	}
+	RasterTarget target;
+	target.stride = TILE_WIDTH;
+	target.depth = s.tileDepth;
+	target.frags = s.tileFrags;
+	target.owners = nullptr;
+	target.locked = false;
+	target.lazyClear = false;
+	target.triangles = shadingTBuffer.data();
+	target.vertices = shadingVBuffer.data();
+	while ((tile = nextTile++) < tileCount) {
+		target.x0 = tile % tilesX * TILE_WIDTH;
+		target.y0 = tile / tilesX * TILE_HEIGHT;
+		target.left = max(scissorLeft, target.x0);
+		target.right = min(scissorRight, target.x0 + TILE_WIDTH - 1);
+		target.down = max(scissorDown, target.y0);
+		target.top = min(scissorTop, target.y0 + TILE_HEIGHT - 1);
+		if (target.left > target.right || target.down > target.top) continue;
+
+		for (int y = target.down;y <= target.top;++y) {
+			memset(target.depth + (y - target.y0) * TILE_WIDTH + target.left - target.x0, 0x50,
+				sizeof(float) * (target.right - target.left + 1));
+		}
+		const vector<int>& bin = tileBins[tile];
+		for (auto it = bin.begin();it != bin.end();++it) {
+			rasterizeTriangle(*it, count, target);
+		}
+		for (int y = target.down;y <= target.top;++y) {
+			int offset = (y - target.y0) * TILE_WIDTH + target.left - target.x0;
+			shaded += __shadeRow(y, target.left, target.right,
+				target.depth + offset, target.frags + offset, nullptr, s);
+		}
+	}
+	return shaded;
+}
+
 //deal with frame functions
+//covered fragments of a row are gathered into a SoA span, then every light
+//is evaluated over the whole span at once
 void Camera::frameThread(int tid) {
-	int* cptr; //color buffer pointer
-	float* dptr; //depth buffer pointer
-	ver* fptr; //fragment buffer pointer
-	vec4 temp, norm(0, 0, 0, 0);
-	vec3 lightColor, fragColor; //vector formed color
-	int bufferStep = screenWidth * (FRAMETHREAD_SIZE - 1), lightingSize;
-	float shadow, tempshadow;
+	int shaded;
+	FragmentCount count;
+	ShadingScratch scratch(screenWidth);
 	UT3D* ut = UT3D::instance();
+	Profiler::setThreadName(string(name) + " frame " + to_string(tid));
 	while (__framethreadState[tid] != EXIT) {
 		//wait for main thread to wake up
+		ProfileZone waitZone("wait", name);
 		unique_lock<mutex> locker(framemutex);
 		while (!frameReady[tid].load()) {
 			threadFrameCon.wait_for(locker, chrono::milliseconds(30));
 		}
+		waitZone.end();
 		frameReady[tid].store(false);
 		//nofity other lighting threads
 		threadFrameCon.notify_one();
 		locker.unlock();
 
-		lightingSize = ut->lightings.size();
-		cptr = this->colorBuffer[0] + tid * screenWidth;
-		dptr = depthBuffer[0] + tid * screenWidth;
-		fptr = frags[0] + tid * screenWidth;
-		for (int y = tid;y < screenHeight;y += FRAMETHREAD_SIZE) {
-			for (int x = 0;x < screenWidth;++x, ++cptr, ++dptr, ++fptr) {
-				if (renderMode == NORMAL) {
-					if (*dptr >= 0x505050) continue; //not out of max view depth
-					if (fptr->texIndex != -1) { //texid != -1 means texture enabled
-						if (fptr->uv(0) < 0) { //reflaction texture
-							fragColor = Color::toColorVector(
-								ut->textureBuffer[fptr->texIndex].getColor(
-									1.0f * x / screenWidth,
-									1.0f * y / screenHeight
-								)
-							);
-						} else {
-							fragColor = Color::toColorVector(
-								ut->textureBuffer[fptr->texIndex].getColor(fptr->uv)
-							);
-						}
-					} else {
-						fragColor = fptr->color;
-					}
-					lightColor = vec3(0, 0, 0);
-
-					//transform the fragment from screen space to world space
-					fptr->position << x, y, 1.0f, (*dptr);
-					screenToWorld(fptr->position);
-
-					//lighting computation
-					float intensity, totalInten = 0.0f;
-					for (auto it = ut->lightings.begin();it != ut->lightings.end();++it) {
-						intensity = (*it)->light(
-							*fptr,
-							this->getPosition() - fptr->position.head(3)
-						);
-						lightColor += intensity * (*it)->getColor();
-						totalInten += intensity;
-					}
-					fragColor *= totalInten;
-					Color::mul(fragColor, lightColor);
-				} else {
-					fragColor = fptr->color;
-				}
-				*cptr = Color::toRGBValue(fragColor);
+		ProfileZone zone("shade", name);
+		scratch.span.eye = shadingPosition;
+		scratch.visible.id = -1;
+		shaded = 0;
+		count.tested = count.passed = count.overwritten = 0;
+		if (tiledEnabled) {
+			shaded = __shadeTiles(scratch, count);
+		} else if (scissorLeft <= scissorRight) { //only rows and columns in the scissor are shaded
+			for (int y = tid;y < screenHeight;y += FRAMETHREAD_SIZE) {
+				if (y < scissorDown || y > scissorTop) continue;
+				shaded += __shadeRow(y, scissorLeft, scissorRight,
+					depthBuffer ? depthBuffer[y] + scissorLeft : nullptr,
+					frags ? frags[y] + scissorLeft : nullptr,
+					clearEpochs ? clearEpochs + y * clearTilesX : nullptr, scratch);
+			}
+		}
+
+		zone.end();
+
+		if (this->isStatEnable) {
+			fragmentShaded += shaded;
+			lightEvaluation += shaded * ut->lightings.size();
+			if (tiledEnabled) {
+				fragmentTested += count.tested;
+				fragmentPassed += count.passed;
+				fragmentOverwritten += count.overwritten;
 			}
-			cptr += bufferStep;
-			dptr += bufferStep;
-			fptr += bufferStep;
 		}
 
-		//add up the count of finished threads
-		++frameFinished;
-		if (frameFinished.load() == FRAMETHREAD_SIZE) { //time to end the lighting work
+		//add up the count of finished threads, the last one completes the frame
+		if (++frameFinished == FRAMETHREAD_SIZE) {
+			if (this->isStatEnable) {
+				shadingStat.lightingTime = (steady_clock::now() - shadingStart).count() / 1000000.0f;
+				shadingStat.fragmentsShaded = fragmentShaded.load();
+				shadingStat.lightEvaluations = lightEvaluation.load();
+				if (tiledEnabled) {
+					shadingStat.fragmentsTested = fragmentTested.load();
+					shadingStat.fragmentsPassed = fragmentPassed.load();
+					shadingStat.fragmentsOverwritten = fragmentOverwritten.load();
+				}
+			}
+			if (frameCallback) {
+				ProfileZone callbackZone("frame callback", name);
+				frameCallback();
+			}
+			frameCompleted.store(true);
 			mainFrameCon.notify_one();
 		}
 	}
 }
 
 void Camera::render() {
+	renderAsync();
+	waitForFrame();
+}
+
+//block until the frame threads have shaded the frame in flight
+void Camera::waitForFrame() {
+	if (!frameInFlight) return;
+	__waitForAllThreads("frame");
+	frameInFlight = false;
+	renderStat = shadingStat;
+}
+
+//the geometry stage only touches vBuffer and tBuffer, so it overlaps
+//the shading of the previous frame, which is waited for before rasterizing
+void Camera::renderAsync(std::function<void()> onFinish) {
 	auto t_start = steady_clock::now();
+	ProfileZone geometryZone("geometry", name);
 
 	//update transform matrix after user's inputs every frame
 	updateCameraState();
 
-	memset(depthBuffer[0], 0x50, //0x50505050 is a large number for float
-		sizeof(float) * this->screenWidth * this->screenHeight);
-	memset(frags[0], 0,
-		sizeof(ver) * this->screenWidth * this->screenHeight);
+	frameStat.trianglesIn = ts->size();
+	const unsigned char* visibleClusters = visibilitySets && visibilitySets->triangles == int(ts->size())
+		? visibilitySets->find(position) : nullptr;
+	frameStat.trianglesRejected = frameStat.trianglesClipped = frameStat.trianglesOccluded = 0;
 
 	/* Geometry Stage */
-	//convert world space to CVV space
-	int size = vs->size();
-	for (int i = 0;i < size;++i) {
-		vBuffer.emplace_back((*vs)[i]);
-		vBuffer[i].position = _worldToCVV * vBuffer[i].position;
+	//convert world space to screen space
+	int sceneSize;
+	if (packedVs) {
+		sceneSize = packedVs->size();
+		//the buffer stays sized across frames, the scene vertices are all rewritten
+		//and resize only drops the clipped ones of the last frame
+		if (int(vBuffer.size()) != sceneSize) vBuffer.resize(sceneSize);
+		__transformVertices(packedVs->positionX.data(), packedVs->positionY.data(),
+			packedVs->positionZ.data(), sceneSize);
+		//per-object attributes are shared by every vertex of a range
+		//depth maps and lines need positions only
+		for (auto range = packedVs->ranges.begin();renderMode == NORMAL && range != packedVs->ranges.end();++range) {
+			for (int i = range->begin;i < range->end;++i) {
+				ver& v = vBuffer[i];
+				packedVs->vertices[i].unpack(v);
+				v.texIndex = range->texIndex;
+				v.receiveShadow = range->receiveShadow;
+			}
+		}
+	} else {
+		sceneSize = vs->size();
+		vBuffer.clear();
+		int padded = (sceneSize + LANE_SIZE - 1) / LANE_SIZE * LANE_SIZE;
+		inputX.assign(padded, 0.0f);
+		inputY.assign(padded, 0.0f);
+		inputZ.assign(padded, 0.0f);
+		for (int i = 0;i < sceneSize;++i) {
+			vBuffer.emplace_back((*vs)[i]);
+			const vec4& p = (*vs)[i].position;
+			inputX[i] = p(0) / p(3);
+			inputY[i] = p(1) / p(3);
+			inputZ[i] = p(2) / p(3);
+		}
+		__transformVertices(inputX.data(), inputY.data(), inputZ.data(), sceneSize);
 	}
 
-	for (std::vector<tri>::const_iterator it = ts->begin();
-		it != ts->end();++it) {
-		triangleClip(*it);
+	//the stencil is dropped for this frame once it crosses the near plane
+	bool stencilValid = stencilTriangles != nullptr;
+	for (int i = 0;stencilValid && i < int(stencilTriangles->size());++i) {
+		for (int j = 0;j < 3;++j) {
+			if (clipCodes[(*stencilTriangles)[i](j)] & 16) stencilValid = false;
+		}
 	}
 
+	//wireframes fill the depth by the triangles for hidden lines only
+	if (renderMode != WIREFRAME || hiddenLine) {
+		if (occlusionEnabled) {
+			__rasterizeOccluders();
+		}
+		int triangles = ts->size();
+		for (int first = 0;first < triangles;first += CLUSTER_SIZE) {
+			int cluster = first / CLUSTER_SIZE, last = min(triangles, first + CLUSTER_SIZE);
+			if ((visibleClusters && !(visibleClusters[cluster >> 3] & (1 << (cluster & 7))))
+				|| (occlusionEnabled && __isClusterOccluded(first, last))) {
+				if (isStatEnable) frameStat.trianglesOccluded += last - first;
+				continue;
+			}
+			for (std::vector<tri>::const_iterator it = ts->begin() + first;
+				it != ts->begin() + last;++it) {
+				int codea = clipCodes[(*it)(0)], codeb = clipCodes[(*it)(1)], codec = clipCodes[(*it)(2)];
+				if (codea & codeb & codec) { //all out of a plane
+					if (isStatEnable) ++frameStat.trianglesRejected;
+				} else if ((codea | codeb | codec) & (16 | 64)) {
+					//cut by the near plane or the clip plane in clip space
+					int size = vBuffer.size();
+					for (int k = 0;k < 3;++k) {
+						ver v(vBuffer[(*it)(k)]);
+						__clipSpacePosition((*it)(k), v.position);
+						vBuffer.emplace_back(v);
+					}
+					triangleClip(tri(size, size + 1, size + 2));
+				} else {
+					tBuffer.emplace_back(*it);
+				}
+			}
+		}
+	}
+	if (renderMode == WIREFRAME) {
+		__clipLines();
+	}
+
+	//vertices made by clipping are still in clip space
 	float pz;
-	for (std::vector<ver>::iterator it = vBuffer.begin();
+	for (std::vector<ver>::iterator it = vBuffer.begin() + sceneSize;
 		it < vBuffer.end();++it) {
 		pz = it->position(3);
 		if (isPerspective) {
@@ -716,28 +2199,124 @@ void Camera::render() {
 		}
 	}
 
+	if (depthSortEnabled) {
+		__sortTriangles();
+	}
+
 	if (this->isStatEnable) {
-		renderStat.geometryTime = (steady_clock::now() - t_start).count() / 1000000.0f;
-		t_start = steady_clock::now();
+		frameStat.geometryTime = (steady_clock::now() - t_start).count() / 1000000.0f;
+	}
+	geometryZone.end();
+
+	//buffers below are still read by the frame in flight
+	waitForFrame();
+	t_start = steady_clock::now();
+	ProfileZone clearZone("clear", name);
+
+	if (stencilValid) {
+		__buildStencil();
+	} else {
+		stencilEnabled = false;
+		scissorLeft = scissorDown = 0;
+		scissorRight = viewportWidth - 1;
+		scissorTop = viewportHeight - 1;
 	}
 
+	if (tiledEnabled) {
+		//tiles are cleared by the frame threads
+	} else if (visBuffer) {
+		for (int y = scissorDown;y <= scissorTop;++y) {
+			atomic<unsigned long long>* visptr = visBuffer + y * screenWidth;
+			for (int x = scissorLeft;x <= scissorRight;++x) {
+				visptr[x].store(_VISIBILITY_EMPTY, memory_order_relaxed);
+			}
+		}
+	} else {
+		//a new epoch makes every clear tile stale, the depth is cleared on first write
+		//and fragments are only read where depth was written this frame
+		if (++clearEpoch == 0) {
+			memset(clearEpochs, 0, sizeof(unsigned int) * clearTilesX * screenHeight);
+			clearEpoch = 1;
+		}
+	}
+
+	if (heatBuffer) {
+		memset(heatBuffer, 0, sizeof(unsigned short) * this->screenWidth * this->screenHeight * 2);
+	}
+	clearZone.end();
+
 	if (!__rasthreads) {
 		__initThreads();
 	}
 	//Raterization Stage, multi-threading
-	__resumeAllThreads("rasterize");
-	__waitForAllThreads("rasterize");
+	bool prePass = isDepthPrePassActive();
+	rasterPhase = prePass || renderMode == WIREFRAME ? RASTER_DEPTH : RASTER_FULL;
+	if (tiledEnabled) {
+		//rasterized tile by tile by the frame threads
+		__binTriangles();
+	} else if (renderMode != WIREFRAME || hiddenLine) {
+		__scheduleRaster();
+		__resumeAllThreads("rasterize");
+		__waitForAllThreads("rasterize");
+	} else {
+		//no triangle is filled, so the counters of the last filled frame are dropped
+		renderingFace.store(0);
+		fragmentTested.store(0);
+		fragmentPassed.store(0);
+		fragmentOverwritten.store(0);
+	}
+	if (prePass) {
+		rasterPhase = RASTER_ATTRIBUTE;
+		__resumeAllThreads("rasterize");
+		__waitForAllThreads("rasterize");
+	}
+	if (renderMode == WIREFRAME) {
+		//lines are tested against the finished depth
+		__binLines();
+		rasterPhase = RASTER_LINES;
+		__resumeAllThreads("rasterize");
+		__waitForAllThreads("rasterize");
+	}
 
-	if (this->renderMode == NORMAL) { //light camera only render depth map
-		memset(colorBuffer[0], 0, sizeof(int) * screenWidth * screenHeight);
-		__resumeAllThreads("frame");
-		__waitForAllThreads("frame");
+	//the depth test is the same with or without the pre-pass, so its
+	//overwrites tell how many payloads a single pass would waste
+	if (prePassMode == PREPASS_AUTO && renderMode == NORMAL && fragmentPassed.load() > 0) {
+		float wasted = 1.0f * fragmentOverwritten.load() / fragmentPassed.load();
+		if (wasted > 0.5f) prePassWanted = true;
+		else if (wasted < 0.25f) prePassWanted = false;
 	}
 
 	if (this->isStatEnable) {
-		renderStat.rasterizationTime = (steady_clock::now() - t_start).count() / 1000000.0f;
+		frameStat.rasterizationTime = (steady_clock::now() - t_start).count() / 1000000.0f;
+	}
+
+	if (clusterRecord) {
+		__recordVisibleClusters();
 	}
 
-	vBuffer.clear();
+	//the frame threads read the triangles of the visibility buffer or
+	//the tiles while the next frame fills new ones
+	if (visBuffer || tiledEnabled) {
+		swap(vBuffer, shadingVBuffer);
+		swap(tBuffer, shadingTBuffer);
+	}
 	tBuffer.clear();
+
+	if (this->renderMode == NORMAL) { //light camera only render depth map
+		//no clearing for the color buffer, frame threads write every pixel
+		if (backColorBuffer) swap(colorBuffer, backColorBuffer);
+		_shadingCVVToWorld = _CVVToWorld;
+		shadingPosition = position;
+		shadingPresentTarget = presentTarget;
+		for (int i = 0;i < 3;++i) shadingFloatTarget[i] = floatTarget[i];
+		shadingStart = steady_clock::now();
+		shadingStat = frameStat;
+		frameCallback = onFinish;
+		frameInFlight = true;
+		__resumeAllThreads("frame");
+	} else {
+		//nothing is left to shade
+		renderStat = frameStat;
+		if (onFinish) onFinish();
+	}
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
+#include <functional>
 #include <vector>
 #include <thread>
 #include <mutex>
@@ -11,10 +13,24 @@ namespace untrue {
 
 	enum RenderMode {
 		NORMAL,
-		WIREFRAME,
+		WIREFRAME, //unique edges of the mesh, see Camera::setHiddenLine()
 		DEPTH //for shadow map
 	};
 
+	//per-pixel counters that can be viewed as heatmaps
+	enum HeatmapType {
+		OVERDRAW, //fragments passing the depth test
+		DEPTH_COMPLEXITY //fragments reaching the depth test
+	};
+
+	//depth pre-pass of NORMAL cameras, AUTO turns it on while most
+	//fragment payloads are overwritten by nearer ones
+	enum PrePassMode {
+		PREPASS_OFF,
+		PREPASS_ON,
+		PREPASS_AUTO
+	};
+
 	enum ThreadState {
 		RUNNING,
 		SUSPENDING,
@@ -26,6 +42,20 @@ namespace untrue {
 		float rasterizationTime;
 		float lightingTime;
 		int renderingFaces;
+
+		//triangles through the geometry stage
+		int trianglesIn,
+			trianglesRejected, //outside the view or behind the clip plane
+			trianglesClipped, //cut by the near plane or the clip plane
+			trianglesOccluded, //hidden behind the occluders or out of the visible set
+			trianglesCulled; //back faces
+
+		//fragments through rasterization and shading
+		int fragmentsTested,
+			fragmentsPassed,
+			fragmentsOverwritten, //passed over a fragment of the same frame
+			fragmentsShaded,
+			lightEvaluations;
 	};
 
 	class Camera {
@@ -34,25 +64,63 @@ namespace untrue {
 		~Camera();
 
 		void bindVertices(std::vector<ver, Eigen::aligned_allocator<ver> >* vs);
+		//compact vertices are unpacked in the geometry stage, only positions for DEPTH
+		void bindVertices(const PackedVertices* vs);
 		void bindTriangles(std::vector<tri>* ts);
+		//call it after changing the bound triangles, wireframes rebuild their edges then
+		void invalidateEdges();
 
 		void render();
 
+		//Geometry and rasterization run on the caller, shading is left to the frame threads
+		//onFinish is called on a frame thread once the frame is shaded
+		void renderAsync(std::function<void()> onFinish = nullptr);
+
+		//block until the frame in flight is shaded
+		void waitForFrame();
+
 		//Convert coordinate from screen space to world space
 		void screenToWorld(vec4&);
+		void screenToWorld(vec4&, const mat4& CVVToWorld);
+
+		//world position of pixel x in row y is depth * (ray + x * rayStep) + base + x * baseStep
+		//rays are stored in this order, so positions are rebuilt without matrix products
+		void getRowRays(int y, const mat4& CVVToWorld, vec4* rays);
 
 		//Convert coordinate from world space to screen space
 		void worldToScreen(vec4&);
+		//lane version of the second half of worldToScreen, clip space x, y are mapped in place
+		void CVVToScreen(lanef& x, lanef& y, const lanef& w);
+
+		//world to clip space matrix, for transforming whole spans at once
+		const mat4& getWorldToCVV();
 
 		//Convert normal vector from world to camera space
 		void normalWorldToCamera(vec3&);
 
 		void setCamera(int, int, RenderMode);
 
+		//render into the bottom-left width x height pixels of the buffers only,
+		//for dynamic resolution without reallocating, the aspect ratio should be kept
+		void setViewport(int width, int height);
+		int getViewportWidth();
+		int getViewportHeight();
+
 		//set plane reflaction matrix
 		void setReflaction(const mat4&);
 		void reflactionEnable(bool enable);
 
+		//user clip plane (a, b, c, d) in world space, ax + by + cz + d < 0 is clipped
+		void setClipPlane(const vec4& plane);
+		void clipPlaneEnable(bool enable);
+
+		//only pixels covered by these triangles are rendered, e.g. a mirror
+		//rasterizing, clearing and shading are kept in their screen rectangle, nullptr to disable
+		void setStencil(const std::vector<tri>* ts);
+
+		//follow position, orientation and projection of another camera
+		void copyView(const Camera&);
+
 		void setPosition(const vec3&);
 		void setLookat(const vec3&);
 		void setUp(const vec3&);
@@ -65,39 +133,158 @@ namespace untrue {
 
 		void setOrthogonal(float depth = 90000.0f);
 
+		//untouched clear tiles are filled first, prefer getDepth() for a few pixels
 		float* getDepthBuffer();
+		//depth of a pixel, pixels no triangle touched this frame are at the far clear depth
+		float getDepth(int x, int y) const {
+			return !clearEpochs || clearEpochs[y * clearTilesX + x / CLEAR_TILE_WIDTH] == clearEpoch
+				? depthBuffer[y][x] : clearDepth;
+		}
 		ver* getFragBuffer();
 		const int* getColorBuffer();
 
+		//keep two color buffers and flip them every frame, so that the buffer of the last
+		//frame stays intact while the next one is shaded, e.g. viewed by a Texture
+		void setDoubleBuffer(bool enable);
+
+		//frame threads copy every shaded row into target, nullptr to disable
+		//the viewport lands at the top-left of target with screenWidth pixels per row
+		void setPresentTarget(unsigned int* target);
+
+		//frame threads write unclamped rows into these planes (bottom-up) instead of
+		//the color buffer, e.g. for post processing, nullptr to disable
+		//planes are viewport sized
+		void setFloatTarget(float* r, float* g, float* b);
+
 		int getScreenWidth();
 		int getScreenHeight();
 
 		void setStatEnable(bool);
+		//stats of the last frame shaded, so that every field belongs to the same frame
 		const Stat& getRenderStat();
 
+		//count fragments per pixel while rasterizing, for debugging only
+		void setHeatmapEnable(bool enable);
+		//colors of the counters of the last frame, top-down 0xRRGGBB of the viewport size
+		//black for nothing, then blue, cyan, green, yellow, red and white for 6 or more
+		bool getHeatmap(HeatmapType type, unsigned int* target);
+
 		void setBackCulling(bool);
 
+		//the rasterizer writes only depth and triangle id of the nearest fragment per pixel,
+		//attributes are interpolated by the frame threads for visible pixels only
+		//it replaces the depth and fragment buffers of NORMAL cameras, 8 bytes instead of 68 per pixel
+		void setVisibilityBuffer(bool enable);
+
+		//tile-based deferred rendering, every frame thread rasterizes the triangles binned to
+		//a tile into its own tile G-buffer and shades it right away while it is in cache
+		//no full screen depth and fragment buffers are kept, rasterizationTime is the binning then
+		void setTiledRendering(bool enable);
+
+		//wireframes test their edges against the depth of the filled triangles, so that
+		//hidden edges are not drawn, otherwise every edge is drawn through the mesh
+		void setHiddenLine(bool enable);
+
+		//submit triangles roughly front to back, so that early-z rejects more fragments
+		//only the order of rasterization changes, so the output is the same except where
+		//triangles meet at exactly the same depth, the first one drawn keeps such a pixel
+		void setDepthSort(bool enable);
+
+		//large front faces are drawn into a coarse depth buffer first, clusters of triangles
+		//behind it are dropped before clipping and rasterization, the output is the same
+		void setOcclusionCulling(bool enable);
+
+		//the sets are looked up by the camera position every frame, clusters out of the
+		//set of the cell are skipped like occluded ones, nullptr to disable
+		void setVisibilitySets(const VisibilitySets* sets);
+		//for baking, every render() sets the bits of the clusters it sees, a bit per cluster
+		//of CLUSTER_SIZE triangles, nullptr to stop recording
+		void setClusterRecord(unsigned char* bits);
+		int getClusterCount();
+
+		//rasterize depth alone first, then write payloads only for the visible fragments
+		void setDepthPrePass(PrePassMode mode);
+		bool isDepthPrePassActive();
+
 		const vec3& getPosition();
 		//return normalized camera direction
 		const vec3& getDirection();
 
 		const RenderMode& getRenderMode();
 
+		//shown as the category of the camera's zones and in its thread names in the profiler
+		void setName(const char* name);
+		const char* getName();
+
 	private:
 		const int RASTHREAD_SIZE = 5;
 		const int FRAMETHREAD_SIZE = 16;
+		//a tile G-buffer is about 70KB, so that it stays in L2
+		const int TILE_WIDTH = 64;
+		const int TILE_HEIGHT = 16;
+		//estimated pixels of work in a rasterizing job, and the cost of setting up a triangle
+		const int RASTER_JOB_COST = 4096;
+		const int TRIANGLE_SETUP_COST = 32;
+		//consecutive triangles sorted and culled as a whole, objects are added in one piece
+		const int CLUSTER_SIZE = 64;
+		//pixels on a side of a block of the occlusion buffer, and the least doubled screen area of an occluder
+		const int COARSE_BLOCK = 8;
+		const float OCCLUDER_MIN_AREA = 1024.0f;
+		//relative depth tolerance of clusters against the blocks, so that the occluders
+		//themselves and the faces lying on them are never culled
+		const float OCCLUSION_DEPTH_BIAS = 0.01f;
+		//wireframe lines are drawn by bands of rows, a band belongs to a single thread
+		const int LINE_BAND_HEIGHT = 16;
+		//relative depth tolerance of lines against their own triangles
+		const float LINE_DEPTH_BIAS = 0.01f;
+		const int LINE_COLOR = 0xc8c8c8;
+		//pixels of a row sharing a clear tag
+		const int CLEAR_TILE_WIDTH = 64;
 
 		float fov, n, f;
 
-		Stat renderStat;
+		const char* name;
+
+		//renderStat is published by waitForFrame() on the calling thread, frameStat is filled
+		//by the geometry and rasterization of the next frame, shadingStat by the frame threads
+		Stat renderStat, frameStat;
 
 		float** depthBuffer;
 
 		ver** frags;
-
-		int** colorBuffer;
-
-		int screenWidth, screenHeight;
+		//triangle ids of the payloads written by the attribute round of the pre-pass,
+		//so that the smallest id wins among fragments of the same final depth
+		int* fragOwners;
+
+		//fast clear, a clear tile holds valid depth only if its tag is the current epoch,
+		//tiles are cleared on the first write of a frame under the lock of their row
+		unsigned int* clearEpochs;
+		unsigned int clearEpoch;
+		int clearTilesX;
+		float clearDepth; //0x50505050
+
+		int** colorBuffer,
+			**backColorBuffer;
+
+		//external surface receiving the shaded rows, e.g. EGE screen buffer
+		unsigned int* presentTarget;
+		float* floatTarget[3];
+
+		//snapshot of the state read by the frame threads, so that the next
+		//frame can update the camera while this one is still being shaded
+		mat4 _shadingCVVToWorld;
+		vec3 shadingPosition;
+		unsigned int* shadingPresentTarget;
+		float* shadingFloatTarget[3];
+		std::chrono::steady_clock::time_point shadingStart;
+		Stat shadingStat;
+
+		//pipelined frame state
+		bool frameInFlight;
+		std::function<void()> frameCallback;
+
+		int screenWidth, screenHeight,
+			viewportWidth, viewportHeight;
 
 		//to check if need perspective division
 		bool isPerspective;
@@ -109,6 +296,112 @@ namespace untrue {
 
 		bool reflactionEnabled;
 
+		bool clipPlaneEnabled;
+		vec4 clipPlane,
+			_clipPlaneCVV;
+
+		//clip space positions and outcodes of the scene vertices, vBuffer holds the
+		//screen positions already, clipping works on copies in clip space
+		//outcode bits 1-32 are the CVV planes as in _getClipCode(), 64 the clip plane
+		std::vector<float> clipX, clipY, clipZ, clipW;
+		std::vector<unsigned char> clipCodes;
+		//positions of unpacked vertices gathered into streams
+		std::vector<float> inputX, inputY, inputZ;
+
+		//stencil mask and its screen rectangle of the current frame
+		const std::vector<tri>* stencilTriangles;
+		unsigned char* stencilBuffer;
+		bool stencilEnabled;
+		int scissorLeft, scissorDown, scissorRight, scissorTop;
+
+		//depth bits in the high half and triangle id in the low half, the nearest
+		//fragment has the smallest key, so rows are rasterized without locking
+		bool visibilityEnabled;
+		std::atomic<unsigned long long>* visBuffer;
+		//triangles of the frame being shaded, read through the visibility buffer
+		std::vector<tri> shadingTBuffer;
+		std::vector<ver, Eigen::aligned_allocator<ver> > shadingVBuffer;
+
+		//triangle ids of every tile in tiled rendering, tiles are row-major over the viewport
+		bool tiledEnabled;
+		int tilesX, tilesY;
+		std::vector<std::vector<int> > tileBins;
+		std::atomic_int nextTile;
+
+		//clusters of triangles radix sorted by their quantized nearest depth
+		bool depthSortEnabled;
+		std::vector<unsigned short> sortKeys;
+		std::vector<int> sortOrder, sortTemp;
+		std::vector<tri> sortedTBuffer;
+
+		//farthest depth of the occluders fully covering each block, FLT_MAX if none does
+		bool occlusionEnabled;
+		int coarseX, coarseY, coarseStride;
+		std::vector<float> coarseDepth;
+
+		const VisibilitySets* visibilitySets;
+		unsigned char* clusterRecord;
+
+		//unique edges of the bound triangles, rebuilt only when the triangles change
+		std::vector<std::pair<int, int> > meshEdges;
+		bool edgesDirty;
+		//edges of the frame after near clipping, as vertices of vBuffer
+		std::vector<std::pair<int, int> > lineBuffer;
+		bool hiddenLine;
+
+		//work of the rasterizing threads, either a batch of small triangles or a band of
+		//rows of a large one, free threads take the next job so that none waits for another
+		struct RasterJob {
+			int first, last; //[first, last) of rasterIds
+			int down, top; //rows the triangles are clipped to
+		};
+		std::vector<int> rasterIds; //culled-in triangles of the frame
+		std::vector<RasterJob> rasterJobs;
+		std::atomic_int nextRasterJob;
+
+		//where rasterizeTriangle() writes, the screen buffers or the G-buffer of a tile
+		struct RasterTarget {
+			int left, down, right, top; //clipping rectangle
+			int x0, y0, stride; //pixel (x, y) is at (y - y0) * stride + x - x0
+			float* depth;
+			ver* frags;
+			int* owners; //nullptr if no pre-pass can run on the target
+			bool lazyClear; //clear tiles of the screen buffers are cleared on first write
+			bool locked; //rows are shared by threads
+			const tri* triangles;
+			const ver* vertices;
+		};
+
+		struct ShadingScratch;
+
+		//attribute planes of the triangle last resolved by a frame thread
+		struct VisibleTriangle {
+			EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+			lanef base, dx, dy; //at (x0, y0) and per pixel
+			float x0, y0;
+			int id, plan, texIndex;
+			bool receiveShadow;
+		};
+
+		//tested and passed fragments of every pixel, interleaved
+		unsigned short* heatBuffer;
+
+		//what the rasterizing threads do in this round
+		enum RasterPhase {
+			RASTER_FULL, //depth test and payloads at once
+			RASTER_DEPTH, //depth pre-pass
+			RASTER_ATTRIBUTE, //payloads of the fragments equal to the final depth
+			RASTER_LINES //wireframe lines, a band of rows per job
+		};
+		RasterPhase rasterPhase;
+		PrePassMode prePassMode;
+		bool prePassWanted; //decision of PREPASS_AUTO for the next frame
+
+		//fragment counters of a rasterizing thread
+		struct FragmentCount {
+			int tested, passed, overwritten;
+		};
+
 		RenderMode renderMode;
 
 		vec3 position,
@@ -133,6 +426,7 @@ namespace untrue {
 		//store transformed vertices
 		std::vector<ver, Eigen::aligned_allocator<ver> > vBuffer,
 			*vs;
+		const PackedVertices* packedVs;
 
 		//multi-threading
 		std::thread *__rasthreads, *__framethreads;
@@ -143,7 +437,10 @@ namespace untrue {
 		std::mutex rasmutex, framemutex; //mutex for critical section while rendering
 		std::condition_variable threadRasCon, mainRasCon, threadFrameCon, mainFrameCon;
 		std::atomic_int rasFinished, renderingFace, frameFinished;
+		std::atomic_int fragmentTested, fragmentPassed, fragmentOverwritten,
+			fragmentShaded, lightEvaluation; //statistics data
 		std::atomic_bool *rasReady, *frameReady;
+		std::atomic_bool frameCompleted;
 
 		mat3 getRotation();
 
@@ -156,19 +453,54 @@ namespace untrue {
 		int _getClipCode(const vec4&);
 		void nearClip(ver&, ver&);
 
+		//a lane of vertices per iteration, transform, outcodes, perspective division
+		//and viewport mapping at once, streams are padded to whole lanes
+		void __transformVertices(const float* x, const float* y, const float* z, int size);
+		void __clipSpacePosition(int index, vec4&);
+
 		void triangleClip(tri);
-		bool lineClip(vec2&, vec2&);
-		int clipcode2d(const vec2&);
+		void nearTriangleClip(tri);
+
+		void __buildStencil();
+		void __rasterizeStencil(const tri&);
 
 		//parallel algorithms
 		void rasterizationThread(int);
 
 		void frameThread(int);
 
-		void rasterizeTriangle(const tri&);
-
-		void drawLine(const ver&, const ver&);
-		void wireframeTriangle(const tri&);
+		void rasterizeTriangle(int index, FragmentCount&, const RasterTarget&);
+		void __rasterizeVisibility(int y, int l, int r, const lanef& v, const lanef& vRight,
+			int index, FragmentCount&);
+		//false if nothing covers the pixel
+		bool __resolveVisibility(unsigned long long key, int x, int y,
+			VisibleTriangle& visible, float& depth, ver& frag);
+
+		int __shadeRow(int y, int left, int right, float* dptr, ver* fptr,
+			const unsigned int* epochs, ShadingScratch&);
+		//clear the stale clear tiles over [left, right] of row y
+		void __clearSpan(int y, int left, int right);
+		void __resolveClears();
+		int __shadeTiles(ShadingScratch&, FragmentCount&);
+		void __binTriangles();
+		void __scheduleRaster();
+		void __sortTriangles();
+		void __rasterizeOccluders();
+		//true if triangles [first, last) of the scene are behind the occluders everywhere
+		bool __isClusterOccluded(int first, int last);
+		void __recordVisibleClusters();
+		//bounding rectangle clipped by the scissor, false if it is empty
+		bool __clippedBounds(const tri&, int& left, int& down, int& right, int& top);
+
+		void __allocDepthBuffers();
+		void __releaseDepthBuffers();
+
+		void __buildEdges();
+		void __clipLines();
+		void __binLines();
+		//clear, draw and present the rows of a band
+		void __drawLineBand(const RasterJob&);
+		void __drawLine(const std::pair<int, int>&, int down, int top);
 
 		void __initThreads();
 
@@ -1,12 +1,13 @@
 #include "InputHandler.h"
 #include "graphics.h"
 #include "UT3D.h"
+#include "Profiler.h"
 
 using namespace untrue;
 
 bool InputHandler::needExit = false;
 
-//룬Ӱ
+//处理输入，影响相机漫游
 void InputHandler::handle(float deltaTime) {
 	UT3D* ut = UT3D::instance();
 
@@ -22,7 +23,7 @@ void InputHandler::handle(float deltaTime) {
 	const float moveSpeed = 350.0f,
 		rotateSpeed = 0.15f;
 
-	//delayĹܻ̿ж¼֣Ӧõ֡һԴ
+	//delay的过程可能会有多个键鼠事件出现，因此应该当帧一次性处理完
 	while (mousemsg()) {
 		nowmouse = getmouse();
 		if (nowmouse.is_down()) {
@@ -34,7 +35,7 @@ void InputHandler::handle(float deltaTime) {
 
 		if (isClicked) {
 			if (nowmouse.is_move()) {
-				//ͼοĻY뱾˶ĻY᷽෴
+				//图形库的屏幕Y轴与本人定义的屏幕Y轴方向相反
 				ut->mainCamera->rotateBy(vec3(
 					mouse.y - nowmouse.y,
 					0.0,
@@ -66,6 +67,30 @@ void InputHandler::handle(float deltaTime) {
 			inten -= 0.4f;
 			ut->lightings[0]->setIntensity(inten);
 			continue;
+		} else if (key.key == 'P') { //start a trace, or stop it and save
+			if (key.msg == key_msg_down) {
+				if (Profiler::isEnabled()) {
+					Profiler::setEnable(false);
+					ut->flush();
+					Profiler::save("trace.json");
+				} else {
+					Profiler::clear();
+					Profiler::setEnable(true);
+				}
+			}
+			continue;
+		} else if (key.key == 'H') { //count fragments, or save the heatmaps and stop
+			if (key.msg == key_msg_down) {
+				static bool heatmapEnabled = false;
+				if (heatmapEnabled) {
+					ut->flush();
+					ut->saveHeatmap("overdraw.ppm", OVERDRAW);
+					ut->saveHeatmap("depth_complexity.ppm", DEPTH_COMPLEXITY);
+				}
+				heatmapEnabled = !heatmapEnabled;
+				ut->setHeatmapEnable(heatmapEnabled);
+			}
+			continue;
 		} else if (key.key == key_esc) { //exit
 			needExit = true;
 			continue; //skip moving signal
@@ -3,6 +3,15 @@
 #include <algorithm>
 
 using namespace untrue;
+using Eigen::Map;
+
+ShadingLanes::ShadingLanes(const ShadingSpan& span, int i)
+	: x(Map<const lanef>(span.x + i)), depth(Map<const lanef>(span.depth + i)),
+	px(Map<const lanef>(span.px + i)), py(Map<const lanef>(span.py + i)),
+	pz(Map<const lanef>(span.pz + i)), nx(Map<const lanef>(span.nx + i)),
+	ny(Map<const lanef>(span.ny + i)), nz(Map<const lanef>(span.nz + i)),
+	receiveShadow(Map<const lanef>(span.receiveShadow + i)) {
+}
 
 Light::Light(bool isStatic, int size){
 	isShadowmapBaked = false;
@@ -10,6 +19,7 @@ Light::Light(bool isStatic, int size){
 	this->isStatic = isStatic;
 
 	lightCamera = new Camera();
+	lightCamera->setName("shadow");
 	lightCamera->setCamera(size, size, DEPTH);
 	lightCamera->setPosition(vec3(0, 0, 0));
 	lightCamera->setLookat(vec3(0, 1, 0));
@@ -60,13 +70,64 @@ void Light::setIntensity(float intensity) {
 	this->intensity = intensity;
 }
 
+bool Light::needBake() {
+	return !(isStatic && isShadowmapBaked);
+}
+
 //simple shadowmap baking logic for spot light and directional light
 void Light::bakeShadowmap() {
-	if (isStatic && isShadowmapBaked) return;
+	if (!needBake()) return;
 	lightCamera->render();
 	isShadowmapBaked = true;
 }
 
+//fallback for lights without a batched implementation
+void Light::lightSpan(const ShadingSpan& span, float* intensity) {
+	ver frag;
+	for (int i = 0;i < span.count;++i) {
+		frag.position << span.px[i], span.py[i], span.pz[i], 1.0f;
+		frag.normal << span.nx[i], span.ny[i], span.nz[i];
+		frag.receiveShadow = span.receiveShadow[i] > 0.0f;
+		intensity[i] = light(frag, span.eye - frag.position.head(3));
+	}
+}
+
+/*
+* same model as the light() functions, evaluated on LANE_SIZE fragments
+* uses fast reciprocal square root for the normalizations
+*/
+lanef Light::blinnPhong(const ShadingLanes& frag, const lanef& lx, const lanef& ly,
+	const lanef& lz, const vec3& eye) {
+	//diffuse
+	lanef ret = (frag.nx * lx + frag.ny * ly + frag.nz * lz).max(0.0f);
+
+	//specular, half vector
+	lanef hx = lx + (eye(0) - frag.px),
+		hy = ly + (eye(1) - frag.py),
+		hz = lz + (eye(2) - frag.pz);
+	lanef temp = (frag.nx * hx + frag.ny * hy + frag.nz * hz)
+		* (hx.square() + hy.square() + hz.square()).rsqrt();
+	temp = temp.max(0.0f);
+	//Ns = 16
+	return ret + temp.square().square().square().square();
+}
+
+//camera-to-light transform, done once per span instead of once per fragment
+void Light::spanToLight(const ShadingSpan& span, vec4* lightRays) {
+	const mat4& m = lightCamera->getWorldToCVV();
+	for (int i = 0;i < 4;++i) lightRays[i] = m * span.rays[i];
+}
+
+void Light::lanesToLight(const ShadingLanes& frag, const vec4* lightRays,
+	lanef& sx, lanef& sy, lanef& z) {
+	const vec4 &ray = lightRays[0], &step = lightRays[1],
+		&base = lightRays[2], &baseStep = lightRays[3];
+	sx = frag.depth * (ray(0) + frag.x * step(0)) + base(0) + frag.x * baseStep(0);
+	sy = frag.depth * (ray(1) + frag.x * step(1)) + base(1) + frag.x * baseStep(1);
+	z = frag.depth * (ray(3) + frag.x * step(3)) + base(3) + frag.x * baseStep(3);
+	lightCamera->CVVToScreen(sx, sy, z);
+}
+
 /*** SPOT LIGHT ***/
 SpotLight::SpotLight(bool isStatic, int size)
 	: Light(isStatic, size){
@@ -131,7 +192,51 @@ float SpotLight::shadow(const ver& frag) {
 	bias = -0.0024 / bias;
 	bias = std::max(-z / 20000.0f, bias);
 	bias = std::min(bias, z / 20000.0f);
-	return z * (1.0 - bias) <= lightCamera->getDepthBuffer()[y * shadowmapSize + x] ? 0.0f : 1.0f;
+	return z * (1.0 - bias) <= lightCamera->getDepth(x, y) ? 0.0f : 1.0f;
+}
+
+void SpotLight::lightSpan(const ShadingSpan& span, float* intensity) {
+	const vec3& pos = lightCamera->getPosition();
+	vec4 lightRays[4];
+	spanToLight(span, lightRays);
+	for (int i = 0;i < span.count;i += LANE_SIZE) {
+		ShadingLanes frag(span, i);
+		lanef lx = pos(0) - frag.px, ly = pos(1) - frag.py, lz = pos(2) - frag.pz;
+		lanef dist = lx.square() + ly.square() + lz.square(), inv = dist.rsqrt();
+		lanef ret = 0.20f + (this->intensity * 10000.0f) * dist.inverse()
+			* blinnPhong(frag, lx * inv, ly * inv, lz * inv, span.eye);
+		//ambient value for fragments in shadow
+		if ((frag.receiveShadow > 0.0f).any()) {
+			ret = (frag.receiveShadow * shadowLanes(frag, lightRays) > 0.0f).select(0.20f, ret);
+		}
+		Map<lanef>(intensity + i) = ret;
+	}
+}
+
+lanef SpotLight::shadowLanes(const ShadingLanes& frag, const vec4* lightRays) {
+	lanef sx, sy, z;
+	lanesToLight(frag, lightRays, sx, sy, z);
+	lanei x = sx.cast<int>(), y = sy.cast<int>(),
+		xx = x - halfSize, yy = y - halfSize;
+
+	//out of range or outside the lighting circle
+	laneb out = (x < 0) || (y < 0) || (x >= shadowmapSize) || (y >= shadowmapSize)
+		|| (z <= 0.0f) || (xx * xx + yy * yy > halfSize * halfSize);
+
+	//slope based shadow bias
+	const vec3& pos = lightCamera->getPosition();
+	lanef dx = frag.px - pos(0), dy = frag.py - pos(1), dz = frag.pz - pos(2);
+	lanef bias = (frag.nx * dx + frag.ny * dy + frag.nz * dz)
+		* (dx.square() + dy.square() + dz.square()).rsqrt();
+	out = out || (bias.abs() < 0.00001f);
+	bias = (-0.0024f * bias.inverse()).max(-z / 20000.0f).min(z / 20000.0f);
+
+	//depth fetching is the only scalar part
+	lanef d;
+	for (int i = 0;i < LANE_SIZE;++i) {
+		d(i) = out(i) ? 0.0f : lightCamera->getDepth(x(i), y(i));
+	}
+	return (out || (z * (1.0f - bias) > d)).cast<float>();
 }
 
 /*** DIRECTIONAL LIGHT ***/
@@ -164,6 +269,47 @@ float DirectionalLight::light(const ver& frag, const vec3& eyedir) {
 	return ret;
 }
 
+void DirectionalLight::lightSpan(const ShadingSpan& span, float* intensity) {
+	const vec3& pos = lightCamera->getPosition();
+	vec4 lightRays[4];
+	spanToLight(span, lightRays);
+	//directional light has only one direction
+	vec3 dir = -lightCamera->getDirection();
+	lanef lx = lanef::Constant(dir(0)), ly = lanef::Constant(dir(1)), lz = lanef::Constant(dir(2));
+	for (int i = 0;i < span.count;i += LANE_SIZE) {
+		ShadingLanes frag(span, i);
+		lanef dist = (pos(0) - frag.px).square() + (pos(1) - frag.py).square()
+			+ (pos(2) - frag.pz).square();
+		lanef ret = 0.20f + (this->intensity * 10000.0f) * dist.inverse()
+			* blinnPhong(frag, lx, ly, lz, span.eye);
+		if ((frag.receiveShadow > 0.0f).any()) {
+			ret = (frag.receiveShadow * shadowLanes(frag, lightRays) > 0.0f).select(0.20f, ret);
+		}
+		Map<lanef>(intensity + i) = ret;
+	}
+}
+
+lanef DirectionalLight::shadowLanes(const ShadingLanes& frag, const vec4* lightRays) {
+	lanef sx, sy, z;
+	lanesToLight(frag, lightRays, sx, sy, z);
+	lanei x = sx.cast<int>(), y = sy.cast<int>();
+
+	laneb out = (x < 0) || (y < 0) || (x >= shadowmapSize) || (y >= shadowmapSize)
+		|| (z <= 0.0f);
+
+	const vec3& dir = lightCamera->getDirection();
+	lanef bias = frag.nx * dir(0) + frag.ny * dir(1) + frag.nz * dir(2);
+	out = out || (bias.abs() < 0.00001f);
+	bias = (-0.0024f * bias.inverse()).max(-z / 20000.0f).min(z / 20000.0f);
+	bias += 3.0f * z.inverse();
+
+	lanef d;
+	for (int i = 0;i < LANE_SIZE;++i) {
+		d(i) = out(i) ? 0.0f : lightCamera->getDepth(x(i), y(i));
+	}
+	return (out || (z * (1.0f - bias) > d)).cast<float>();
+}
+
 float DirectionalLight::shadow(const ver& frag) {
 	vec4 pos(frag.position);
 	lightCamera->worldToScreen(pos);
@@ -182,7 +328,7 @@ float DirectionalLight::shadow(const ver& frag) {
 	bias = std::min(bias, z / 20000.0f);
 	bias += 3.0 / z;
 
-	return z * (1.0 - bias) <= lightCamera->getDepthBuffer()[y * shadowmapSize + x] ? 0.0f : 1.0f;
+	return z * (1.0 - bias) <= lightCamera->getDepth(x, y) ? 0.0f : 1.0f;
 }
 
 /*** POINT LIGHT***/
@@ -199,7 +345,7 @@ PointLight::~PointLight() {
 
 //bake cubemap for point light
 void PointLight::bakeShadowmap() {
-	if (isStatic && isShadowmapBaked) return;
+	if (!needBake()) return;
 	//render every sides for the cubemap
 	lightCamera->render();
 	depthcube->loadTextureByFace(lightCamera->getDepthBuffer(), FRONT);
@@ -251,6 +397,42 @@ float PointLight::light(const ver& frag, const vec3& eyedir) {
 	return ret;
 }
 
+void PointLight::lightSpan(const ShadingSpan& span, float* intensity) {
+	const vec3& pos = lightCamera->getPosition();
+	for (int i = 0;i < span.count;i += LANE_SIZE) {
+		ShadingLanes frag(span, i);
+		lanef lx = pos(0) - frag.px, ly = pos(1) - frag.py, lz = pos(2) - frag.pz;
+		lanef dist = lx.square() + ly.square() + lz.square(), inv = dist.rsqrt();
+		lanef ret = 0.20f + (this->intensity * 10000.0f) * dist.inverse()
+			* blinnPhong(frag, lx * inv, ly * inv, lz * inv, span.eye);
+		if ((frag.receiveShadow > 0.0f).any()) {
+			ret = (frag.receiveShadow * shadowLanes(frag) > 0.0f).select(0.20f, ret);
+		}
+		Map<lanef>(intensity + i) = ret;
+	}
+}
+
+lanef PointLight::shadowLanes(const ShadingLanes& frag) {
+	const vec3& pos = lightCamera->getPosition();
+	lanef dx = frag.px - pos(0), dy = frag.py - pos(1), dz = frag.pz - pos(2);
+	//depth of fragment
+	lanef z = dx.abs().max(dy.abs()).max(dz.abs());
+
+	lanef inv = (dx.square() + dy.square() + dz.square()).rsqrt();
+	dx *= inv; dy *= inv; dz *= inv;
+	lanef bias = frag.nx * dx + frag.ny * dy + frag.nz * dz;
+	//a fragment at the light position gives NaN, keep it off the cubemap
+	laneb out = (bias.abs() < 0.00001f) || (bias != bias);
+	bias = (-0.0024f * bias.inverse()).max(-z / 100000.0f).min(z / 100000.0f);
+	bias -= 1.6f * z.inverse();
+
+	lanef d;
+	for (int i = 0;i < LANE_SIZE;++i) {
+		d(i) = out(i) ? 0.0f : depthcube->getColor(vec3(dx(i), dy(i), dz(i)));
+	}
+	return (out || (z * (1.0f - bias) > d)).cast<float>();
+}
+
 //TODO: use cubemap to sample the depth
 //point light use cubemap as shadowmap
 float PointLight::shadow(const ver& frag) {
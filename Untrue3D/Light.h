@@ -3,6 +3,25 @@
 #include "Camera.h"
 
 namespace untrue {
+	//SoA batch of fragments for Light::lightSpan()
+	//arrays must be padded to count, which is a multiple of LANE_SIZE
+	struct ShadingSpan {
+		const float *x, *depth; //screen space x and depth in the row
+		const float *px, *py, *pz; //world space position
+		const float *nx, *ny, *nz; //world space normal
+		const float *receiveShadow; //1 or 0
+		vec3 eye; //eye position, eye direction is eye - position
+		int count;
+		//row rays of the camera, see Camera::getRowRays()
+		vec4 rays[4];
+	};
+
+	//LANE_SIZE fragments of a span loaded into lanes
+	struct ShadingLanes {
+		ShadingLanes(const ShadingSpan&, int offset);
+		lanef x, depth, px, py, pz, nx, ny, nz, receiveShadow;
+	};
+
 	class Light{
 	public:
 		Light(bool isStatic, int size);
@@ -13,6 +32,8 @@ namespace untrue {
 		virtual float light(const ver&, const vec3&) = 0;
 		//return whether the fragment is in shadow (1 or 0)
 		virtual float shadow(const ver&) = 0;
+		//batched light(), write light intensity of every fragment in the span
+		virtual void lightSpan(const ShadingSpan&, float* intensity);
 
 		//light transform
 		virtual Camera* getCamera();
@@ -22,6 +43,8 @@ namespace untrue {
 
 		virtual void bakeShadowmap();
 		virtual void setShadowmapSize(int);
+		//whether the next bakeShadowmap() call would render anything
+		bool needBake();
 
 		//light color and intensity
 		virtual vec3 getColor();
@@ -41,6 +64,16 @@ namespace untrue {
 		Camera* lightCamera;
 
 		vec3 lightColor;
+
+		//diffuse plus specular factor of Blinn-Phong, l must be normalized
+		static lanef blinnPhong(const ShadingLanes&, const lanef& lx, const lanef& ly,
+			const lanef& lz, const vec3& eye);
+
+		//map the camera rays of a span into the light camera's clip space
+		void spanToLight(const ShadingSpan&, vec4* lightRays);
+		//light camera screen coordinate of fragments from the rays above
+		void lanesToLight(const ShadingLanes&, const vec4* lightRays,
+			lanef& sx, lanef& sy, lanef& z);
 	private:
 	};
 
@@ -50,6 +83,9 @@ namespace untrue {
 
 		virtual float light(const ver&, const vec3&);
 		virtual float shadow(const ver&);
+		virtual void lightSpan(const ShadingSpan&, float* intensity);
+	private:
+		lanef shadowLanes(const ShadingLanes&, const vec4* lightRays);
 	};
 
 	class DirectionalLight : public Light {
@@ -58,6 +94,9 @@ namespace untrue {
 
 		virtual float light(const ver&, const vec3&);
 		virtual float shadow(const ver&);
+		virtual void lightSpan(const ShadingSpan&, float* intensity);
+	private:
+		lanef shadowLanes(const ShadingLanes&, const vec4* lightRays);
 	};
 
 	class PointLight : public Light {
@@ -67,11 +106,13 @@ namespace untrue {
 
 		virtual float light(const ver&, const vec3&);
 		virtual float shadow(const ver&);
+		virtual void lightSpan(const ShadingSpan&, float* intensity);
 
 		virtual void bakeShadowmap();
 		virtual void setShadowmapSize(int);
 
 		Cubemap* depthcube;
 	private:
+		lanef shadowLanes(const ShadingLanes&);
 	};
 };
@@ -0,0 +1,398 @@
+#include "PostProcess.h"
+#include "Profiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace Eigen;
+using namespace std;
+using namespace untrue;
+
+//normalized weights of 2 * radius + 1 taps
+static vector<float> _gaussianKernel(int radius, float sigma) {
+	vector<float> kernel(2 * radius + 1);
+	float sum = 0.0f;
+	for (int i = -radius;i <= radius;++i) {
+		kernel[i + radius] = exp(-0.5f * i * i / (sigma * sigma));
+		sum += kernel[i + radius];
+	}
+	for (auto it = kernel.begin();it != kernel.end();++it) {
+		*it /= sum;
+	}
+	return kernel;
+}
+
+//copy a row into dst with its edge values repeated radius times on both sides
+static void _padRow(const float* src, float* dst, int count, int radius) {
+	for (int i = 0;i < radius;++i) {
+		dst[i] = src[0];
+		dst[radius + count + i] = src[count - 1];
+	}
+	memcpy(dst + radius, src, sizeof(float) * count);
+}
+
+//horizontal convolution of a padded row, one whole row per tap
+static void _convolveRow(const float* padded, float* dst, int count, const vector<float>& kernel) {
+	Map<ArrayXf> out(dst, count);
+	int taps = kernel.size();
+	out = kernel[0] * Map<const ArrayXf>(padded, count);
+	for (int k = 1;k < taps;++k) {
+		out += kernel[k] * Map<const ArrayXf>(padded + k, count);
+	}
+}
+
+//vertical convolution of row y, rows out of the plane are clamped
+static void _convolveColumn(const float* plane, float* dst, int width, int height,
+	int y, const vector<float>& kernel) {
+	int taps = kernel.size(), radius = taps / 2, sy;
+	Map<ArrayXf> out(dst, width);
+	out.setZero();
+	for (int k = 0;k < taps;++k) {
+		sy = min(max(y + k - radius, 0), height - 1);
+		out += kernel[k] * Map<const ArrayXf>(plane + sy * width, width);
+	}
+}
+
+//average 2x2 blocks of rows a and b into dst
+static void _downsampleRow(const float* a, const float* b, float* dst, int count) {
+	typedef Map<const ArrayXf, 0, InnerStride<2> > StridedRow;
+	Map<ArrayXf>(dst, count) = 0.25f * (StridedRow(a, count) + StridedRow(a + 1, count)
+		+ StridedRow(b, count) + StridedRow(b + 1, count));
+}
+
+GaussianBlur::GaussianBlur(int radius, float sigma) {
+	this->radius = radius;
+	this->kernel = _gaussianKernel(radius, sigma);
+	this->temp = nullptr;
+}
+
+GaussianBlur::~GaussianBlur() {
+	if (temp) delete[] temp;
+}
+
+void GaussianBlur::resize(int width, int height) {
+	this->width = width;
+	this->height = height;
+	if (temp) delete[] temp;
+	temp = new float[width * height * 3];
+}
+
+int GaussianBlur::getStageCount() {
+	return 2;
+}
+
+//the vertical stage reads rows of other bands
+bool GaussianBlur::needBarrier(int stage) {
+	return stage == 1;
+}
+
+void GaussianBlur::process(int stage, PostFrame& frame, int begin, int end) {
+	float* planes[3] = { frame.r, frame.g, frame.b };
+	int size = width * height;
+	if (stage == 0) { //horizontal, frame to temp
+		vector<float> padded(width + 2 * radius);
+		for (int y = begin;y < end;++y) {
+			for (int c = 0;c < 3;++c) {
+				_padRow(planes[c] + y * width, padded.data(), width, radius);
+				_convolveRow(padded.data(), temp + c * size + y * width, width, kernel);
+			}
+		}
+	} else { //vertical, temp back to frame
+		for (int y = begin;y < end;++y) {
+			for (int c = 0;c < 3;++c) {
+				_convolveColumn(temp + c * size, planes[c] + y * width, width, height, y, kernel);
+			}
+		}
+	}
+}
+
+Bloom::Bloom(float threshold, float intensity, int radius, float sigma) {
+	this->threshold = threshold;
+	this->intensity = intensity;
+	this->radius = radius;
+	this->kernel = _gaussianKernel(radius, sigma);
+	half = quarter = quarterTemp = upsampled = nullptr;
+}
+
+Bloom::~Bloom() {
+	if (half) {
+		delete[] half;
+		delete[] quarter;
+		delete[] quarterTemp;
+		delete[] upsampled;
+	}
+}
+
+//the frame should be at least 4 x 4
+void Bloom::resize(int width, int height) {
+	this->width = width;
+	this->height = height;
+	halfWidth = width / 2; halfHeight = height / 2;
+	quarterWidth = halfWidth / 2; quarterHeight = halfHeight / 2;
+	if (half) {
+		delete[] half;
+		delete[] quarter;
+		delete[] quarterTemp;
+		delete[] upsampled;
+	}
+	half = new float[halfWidth * halfHeight * 3];
+	quarter = new float[quarterWidth * quarterHeight * 3];
+	quarterTemp = new float[quarterWidth * quarterHeight * 3];
+	upsampled = new float[width * quarterHeight * 3];
+	for (int j = 0;j < 4;++j) {
+		phaseCount[j] = (width - j + 3) / 4;
+	}
+}
+
+int Bloom::getStageCount() {
+	return 4;
+}
+
+//downsampling and horizontal blur stay in the band, the rest reads other bands
+bool Bloom::needBarrier(int stage) {
+	return stage >= 2;
+}
+
+void Bloom::process(int stage, PostFrame& frame, int begin, int end) {
+	float* planes[3] = { frame.r, frame.g, frame.b };
+	int halfSize = halfWidth * halfHeight, quarterSize = quarterWidth * quarterHeight;
+	if (stage == 0) { //bright pass while downsampling to half resolution
+		vector<float> scale(halfWidth);
+		Map<ArrayXf> k(scale.data(), halfWidth);
+		for (int hy = begin / 2;hy < min(end / 2, halfHeight);++hy) {
+			for (int c = 0;c < 3;++c) {
+				const float* row = planes[c] + 2 * hy * width;
+				_downsampleRow(row, row + width, half + c * halfSize + hy * halfWidth, halfWidth);
+			}
+			//keep the part of luminance over the threshold
+			Map<ArrayXf> r(half + hy * halfWidth, halfWidth),
+				g(half + halfSize + hy * halfWidth, halfWidth),
+				b(half + 2 * halfSize + hy * halfWidth, halfWidth);
+			k = 0.2126f * r + 0.7152f * g + 0.0722f * b;
+			k = (k - threshold).max(0.0f) / k.max(1e-4f);
+			r *= k; g *= k; b *= k;
+		}
+	} else if (stage == 1) { //downsample to quarter resolution and blur horizontally
+		vector<float> row(quarterWidth), padded(quarterWidth + 2 * radius);
+		for (int qy = begin / 4;qy < min(end / 4, quarterHeight);++qy) {
+			for (int c = 0;c < 3;++c) {
+				const float* src = half + c * halfSize + 2 * qy * halfWidth;
+				_downsampleRow(src, src + halfWidth, row.data(), quarterWidth);
+				_padRow(row.data(), padded.data(), quarterWidth, radius);
+				_convolveRow(padded.data(), quarterTemp + c * quarterSize + qy * quarterWidth,
+					quarterWidth, kernel);
+			}
+		}
+	} else if (stage == 2) { //vertical blur, then upsample horizontally to full width
+		//column 4i + j lies between quarter pixels i - 1 and i for j < 2, i and i + 1 otherwise,
+		//so every phase j is a strided lerp of the row padded by one pixel on both sides
+		typedef Map<ArrayXf, 0, InnerStride<4> > PhaseRow;
+		const float phaseWeight[4] = { 0.625f, 0.875f, 0.125f, 0.375f };
+		int padded = phaseCount[0] + 3, upsampledSize = width * quarterHeight;
+		vector<float> row(padded);
+		for (int qy = begin / 4;qy < min(end / 4, quarterHeight);++qy) {
+			for (int c = 0;c < 3;++c) {
+				_convolveColumn(quarterTemp + c * quarterSize, row.data() + 1,
+					quarterWidth, quarterHeight, qy, kernel);
+				row[0] = row[1];
+				for (int i = quarterWidth + 1;i < padded;++i) row[i] = row[quarterWidth];
+
+				//the intensity is applied here on a quarter of the rows
+				float* dst = upsampled + c * upsampledSize + qy * width;
+				for (int j = 0;j < 4;++j) {
+					int n = phaseCount[j], base = j < 2 ? 0 : 1;
+					PhaseRow(dst + j, n) = intensity * (
+						(1.0f - phaseWeight[j]) * Map<const ArrayXf>(row.data() + base, n)
+						+ phaseWeight[j] * Map<const ArrayXf>(row.data() + base + 1, n));
+				}
+			}
+		}
+	} else { //upsample vertically and add back to the frame, whole rows at a time
+		int upsampledSize = width * quarterHeight;
+		float fy, wy;
+		int y0, y1;
+		for (int y = begin;y < end;++y) {
+			fy = max(0.0f, (y + 0.5f) / 4.0f - 0.5f);
+			y0 = min(int(fy), quarterHeight - 1);
+			y1 = min(y0 + 1, quarterHeight - 1);
+			wy = fy - y0;
+			for (int c = 0;c < 3;++c) {
+				const float* u = upsampled + c * upsampledSize;
+				Map<ArrayXf>(planes[c] + y * width, width) +=
+					(1.0f - wy) * Map<const ArrayXf>(u + y0 * width, width)
+					+ wy * Map<const ArrayXf>(u + y1 * width, width);
+			}
+		}
+	}
+}
+
+PostProcessor::PostProcessor() {
+	frame.width = frame.height = 0;
+	frame.r = frame.g = frame.b = nullptr;
+	color = nullptr;
+	target = nullptr;
+
+	__postthreads = nullptr;
+	sweepGeneration = 0;
+
+	//unpacking and packing
+	stages.emplace_back(nullptr, 0);
+	stages.emplace_back(nullptr, 1);
+}
+
+PostProcessor::~PostProcessor() {
+	__killThreads();
+	if (frame.r) delete[] frame.r;
+}
+
+void PostProcessor::addPass(PostPass* pass) {
+	passes.push_back(pass);
+	for (int i = 0;i < pass->getStageCount();++i) {
+		stages.insert(stages.end() - 1, make_pair(pass, i));
+	}
+	if (frame.r) pass->resize(frame.width, frame.height);
+}
+
+bool PostProcessor::empty() {
+	return passes.empty();
+}
+
+PostFrame& PostProcessor::getFrame(int width, int height) {
+	if (width != frame.width || height != frame.height) {
+		__resize(width, height);
+	}
+	return frame;
+}
+
+void PostProcessor::process(unsigned int* target, int stride) {
+	this->color = nullptr;
+	this->target = target;
+	this->targetStride = stride;
+	__runChain();
+}
+
+void PostProcessor::process(const int* color, unsigned int* target, int width, int height) {
+	getFrame(width, height);
+	this->color = color;
+	this->target = target;
+	this->targetStride = width;
+	__runChain();
+}
+
+void PostProcessor::__runChain() {
+	ProfileZone zone("post", "post");
+	if (!__postthreads) {
+		__initThreads();
+	}
+
+	//a new sweep starts at every barrier, stages in a sweep are fused band by band
+	int first = 0;
+	for (int i = 1;i < int(stages.size());++i) {
+		if (stages[i].first && stages[i].first->needBarrier(stages[i].second)) {
+			__runSweep(first, i);
+			first = i;
+		}
+	}
+	__runSweep(first, stages.size());
+}
+
+void PostProcessor::__resize(int width, int height) {
+	if (frame.r) delete[] frame.r;
+	frame.width = width;
+	frame.height = height;
+	frame.r = new float[width * height * 3];
+	frame.g = frame.r + width * height;
+	frame.b = frame.g + width * height;
+	bandCount = (height + BAND_SIZE - 1) / BAND_SIZE;
+	for (auto it = passes.begin();it != passes.end();++it) {
+		(*it)->resize(width, height);
+	}
+}
+
+//run stages [first, last) on every band, the caller works on bands as well
+void PostProcessor::__runSweep(int first, int last) {
+	unique_lock<mutex> locker(postmutex);
+	sweepFirst = first;
+	sweepLast = last;
+	postFinished = 0;
+	nextBand.store(0);
+	++sweepGeneration;
+	locker.unlock();
+	threadPostCon.notify_all();
+
+	__workOnBands();
+
+	ProfileZone zone("wait sweep", "post");
+	locker.lock();
+	while (postFinished != POSTTHREAD_SIZE) mainPostCon.wait(locker);
+}
+
+void PostProcessor::__workOnBands() {
+	ProfileZone zone("sweep", "post");
+	int band;
+	while ((band = nextBand++) < bandCount) {
+		int begin = band * BAND_SIZE, end = min(frame.height, begin + BAND_SIZE);
+		for (int i = sweepFirst;i < sweepLast;++i) {
+			__runStage(i, begin, end);
+		}
+	}
+}
+
+void PostProcessor::__runStage(int stage, int begin, int end) {
+	PostPass* pass = stages[stage].first;
+	if (pass) {
+		pass->process(stages[stage].second, frame, begin, end);
+		return;
+	}
+	int width = frame.width;
+	if (stage == 0 && !color) return; //the planes are filled already
+	for (int y = begin;y < end;++y) {
+		if (stage == 0) {
+			Color::unpackSpan(color + y * width,
+				frame.r + y * width, frame.g + y * width, frame.b + y * width, width);
+		} else if (target) { //present while flipping y
+			Color::packSpan(frame.r + y * width, frame.g + y * width, frame.b + y * width,
+				(int*)target + (frame.height - 1 - y) * targetStride, width);
+		}
+	}
+}
+
+void PostProcessor::postThread(int tid) {
+	int generation = 0;
+	Profiler::setThreadName("post " + to_string(tid));
+	while (true) {
+		unique_lock<mutex> locker(postmutex);
+		while (sweepGeneration == generation) threadPostCon.wait(locker);
+		generation = sweepGeneration;
+		if (__postthreadState == EXIT) return;
+		locker.unlock();
+
+		__workOnBands();
+
+		locker.lock();
+		if (++postFinished == POSTTHREAD_SIZE) mainPostCon.notify_one();
+	}
+}
+
+void PostProcessor::__initThreads() {
+	__postthreadState = RUNNING;
+	__postthreads = new thread[POSTTHREAD_SIZE];
+	for (int i = 0;i < POSTTHREAD_SIZE;++i) {
+		__postthreads[i] = std::thread(&PostProcessor::postThread, this, i);
+	}
+}
+
+void PostProcessor::__killThreads() {
+	if (!__postthreads) return;
+	unique_lock<mutex> locker(postmutex);
+	__postthreadState = EXIT;
+	++sweepGeneration;
+	locker.unlock();
+	threadPostCon.notify_all();
+	for (int i = 0;i < POSTTHREAD_SIZE;++i) {
+		__postthreads[i].join();
+	}
+	delete[] __postthreads;
+	__postthreads = nullptr;
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Camera.h"
+
+namespace untrue {
+	//float planes of a frame, not clamped yet, rows are bottom-up like the color buffer
+	struct PostFrame {
+		int width, height;
+		float *r, *g, *b;
+	};
+
+	//a post effect made of stages, every stage runs over bands of rows in parallel
+	//a stage without barrier runs right after the previous one on the same band,
+	//so that the band is read and written once while it is still in cache
+	class PostPass {
+	public:
+		virtual ~PostPass() {}
+
+		//called when the frame size changes, work buffers are allocated here
+		virtual void resize(int width, int height) = 0;
+
+		virtual int getStageCount() = 0;
+
+		//true if the stage reads rows of the previous stage out of its own band
+		virtual bool needBarrier(int stage) = 0;
+
+		//process the full resolution rows [begin, end), begin is a multiple of 4
+		virtual void process(int stage, PostFrame& frame, int begin, int end) = 0;
+	};
+
+	//separable gaussian blur at full resolution
+	class GaussianBlur : public PostPass {
+	public:
+		GaussianBlur(int radius = 3, float sigma = 1.5f);
+		~GaussianBlur();
+
+		void resize(int width, int height);
+		int getStageCount();
+		bool needBarrier(int stage);
+		void process(int stage, PostFrame& frame, int begin, int end);
+	private:
+		int radius;
+		std::vector<float> kernel;
+
+		//horizontally blurred planes
+		float* temp;
+		int width, height;
+	};
+
+	//bright parts are blurred at quarter resolution and added back
+	class Bloom : public PostPass {
+	public:
+		Bloom(float threshold = 0.7f, float intensity = 0.6f, int radius = 4, float sigma = 2.0f);
+		~Bloom();
+
+		void resize(int width, int height);
+		int getStageCount();
+		bool needBarrier(int stage);
+		void process(int stage, PostFrame& frame, int begin, int end);
+	private:
+		float threshold, intensity;
+		int radius;
+		std::vector<float> kernel;
+
+		int width, height,
+			halfWidth, halfHeight,
+			quarterWidth, quarterHeight;
+		//downsample pyramid, 3 planes each
+		float *half, *quarter, *quarterTemp;
+		//blurred quarter rows upsampled to full width, the last stage only lerps whole rows
+		float* upsampled;
+
+		//full resolution columns of the same phase in a group of 4
+		int phaseCount[4];
+	};
+
+	//runs a chain of passes over the shaded frame and presents the result
+	class PostProcessor {
+	public:
+		PostProcessor();
+		~PostProcessor();
+
+		//passes are run in order, they are owned by the caller
+		void addPass(PostPass*);
+		bool empty();
+
+		//planes of the frame, e.g. for Camera::setFloatTarget()
+		PostFrame& getFrame(int width, int height);
+
+		//run the chain over the planes of getFrame(), target is top-down 0xRRGGBB
+		//with stride pixels per row, the frame lands at its top-left
+		void process(unsigned int* target, int stride);
+		//same as above but the frame is unpacked from color, which is bottom-up 0xRRGGBB
+		void process(const int* color, unsigned int* target, int width, int height);
+	private:
+		const int POSTTHREAD_SIZE = 4;
+		const int BAND_SIZE = 16; //multiple of 4 for the quarter resolution passes
+
+		std::vector<PostPass*> passes;
+
+		//unpacking and packing are the first and the last stage,
+		//stages of passes are stored as (pass, stage)
+		std::vector<std::pair<PostPass*, int> > stages;
+
+		PostFrame frame;
+		const int* color;
+		unsigned int* target;
+		int targetStride;
+
+		//multi-threading
+		std::thread* __postthreads;
+		volatile ThreadState __postthreadState;
+
+		//threads synchronizing
+		std::mutex postmutex;
+		std::condition_variable threadPostCon, mainPostCon;
+		int sweepGeneration, sweepFirst, sweepLast, postFinished, bandCount;
+		std::atomic_int nextBand;
+
+		void postThread(int);
+
+		void __resize(int width, int height);
+		void __runChain();
+		void __runSweep(int first, int last);
+		void __workOnBands();
+		void __runStage(int stage, int begin, int end);
+
+		void __initThreads();
+		void __killThreads();
+	};
+};
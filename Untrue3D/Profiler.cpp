@@ -0,0 +1,143 @@
+#include "Profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+using namespace untrue;
+
+atomic_bool Profiler::enabled(false);
+
+struct ProfileEvent {
+	const char *name, *category;
+	long long start, end;
+};
+
+//events of one thread, only its owner writes
+struct ProfileRing {
+	static const int SIZE = 1 << 16;
+
+	int tid;
+	string name;
+	ProfileEvent* events;
+	atomic<long long> count; //events ever recorded
+};
+
+static const steady_clock::time_point _origin = steady_clock::now();
+
+static mutex _ringsMutex;
+static vector<ProfileRing*> _rings;
+static thread_local ProfileRing* _localRing = nullptr;
+
+//rings are kept after their threads exit, so that they can still be saved
+static ProfileRing* _getRing() {
+	if (!_localRing) {
+		ProfileRing* ring = new ProfileRing();
+		ring->events = new ProfileEvent[ProfileRing::SIZE];
+		ring->count.store(0);
+
+		lock_guard<mutex> locker(_ringsMutex);
+		ring->tid = _rings.size() + 1;
+		ring->name = "thread " + to_string(ring->tid);
+		_rings.push_back(ring);
+		_localRing = ring;
+	}
+	return _localRing;
+}
+
+//names are written into json strings
+static string _escape(const char* s) {
+	string ret;
+	for (;*s;++s) {
+		if (*s == '"' || *s == '\\') ret += '\\';
+		ret += *s;
+	}
+	return ret;
+}
+
+void Profiler::setEnable(bool enable) {
+	enabled.store(enable);
+}
+
+void Profiler::setThreadName(const string& name) {
+	ProfileRing* ring = _getRing();
+	lock_guard<mutex> locker(_ringsMutex);
+	ring->name = name;
+}
+
+void Profiler::record(const char* name, const char* category, long long start, long long end) {
+	ProfileRing* ring = _getRing();
+	long long count = ring->count.load(memory_order_relaxed);
+	ProfileEvent& e = ring->events[count & (ProfileRing::SIZE - 1)];
+	e.name = name;
+	e.category = category;
+	e.start = start;
+	e.end = end;
+	ring->count.store(count + 1, memory_order_release);
+}
+
+long long Profiler::now() {
+	return duration_cast<nanoseconds>(steady_clock::now() - _origin).count();
+}
+
+bool Profiler::save(const char* path) {
+	ofstream out(path);
+	if (out.is_open() == false) {
+		return false;
+	}
+	lock_guard<mutex> locker(_ringsMutex);
+	bool first = true;
+	char buffer[512];
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	for (auto it = _rings.begin();it != _rings.end();++it) {
+		ProfileRing* ring = *it;
+		snprintf(buffer, sizeof(buffer),
+			"%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			first ? "" : ",", ring->tid, _escape(ring->name.c_str()).c_str());
+		out << buffer;
+		first = false;
+
+		long long count = ring->count.load(memory_order_acquire);
+		for (long long i = max(0LL, count - ProfileRing::SIZE);i < count;++i) {
+			const ProfileEvent& e = ring->events[i & (ProfileRing::SIZE - 1)];
+			//timestamps are in microseconds
+			snprintf(buffer, sizeof(buffer),
+				",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				_escape(e.name).c_str(), _escape(e.category).c_str(), ring->tid,
+				e.start / 1000.0, (e.end - e.start) / 1000.0);
+			out << buffer;
+		}
+	}
+	out << "\n]}\n";
+	out.close();
+	return true;
+}
+
+void Profiler::clear() {
+	lock_guard<mutex> locker(_ringsMutex);
+	for (auto it = _rings.begin();it != _rings.end();++it) {
+		(*it)->count.store(0);
+	}
+}
+
+ProfileZone::ProfileZone(const char* name, const char* category) {
+	this->name = name;
+	this->category = category;
+	this->start = Profiler::isEnabled() ? Profiler::now() : -1;
+}
+
+ProfileZone::~ProfileZone() {
+	end();
+}
+
+void ProfileZone::end() {
+	if (start >= 0) {
+		Profiler::record(name, category, start, Profiler::now());
+		start = -1;
+	}
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+namespace untrue {
+	//timeline of scoped zones, saved as Chrome trace json for chrome://tracing or ui.perfetto.dev
+	//every thread records into its own ring buffer without locking,
+	//only the latest events are kept once a buffer is full
+	class Profiler {
+	public:
+		static void setEnable(bool enable);
+		static bool isEnabled() {
+			return enabled.load(std::memory_order_relaxed);
+		}
+
+		//name of the calling thread in the timeline
+		static void setThreadName(const std::string& name);
+
+		//record a finished zone of the calling thread, name and category must outlive the profiler
+		static void record(const char* name, const char* category, long long start, long long end);
+
+		//nanoseconds since the profiler started
+		static long long now();
+
+		//write recorded events of all threads, best called while nothing is rendering
+		static bool save(const char* path);
+		static void clear();
+	private:
+		static std::atomic_bool enabled;
+	};
+
+	//records the zone from construction to destruction if the profiler is enabled
+	class ProfileZone {
+	public:
+		ProfileZone(const char* name, const char* category = "scene");
+		~ProfileZone();
+
+		//record the zone now instead of on destruction
+		void end();
+	private:
+		const char *name, *category;
+		long long start; //-1 if the profiler was disabled
+	};
+};
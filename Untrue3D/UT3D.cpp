@@ -1,6 +1,8 @@
 #include "UT3D.h"
+#include "Profiler.h"
 #include "Eigen/Geometry" //for vector cross calculation
 
+#include <cassert>
 #include <iostream>
 #include <fstream>
 #include <chrono>
@@ -32,6 +34,9 @@ void UT3D::init(int width, int height, RenderMode renderMode) {
 	WIN_WIDTH = width;
 
 	this->reflactionTextureIndex = -1;
+	this->reflactionCamera = nullptr;
+	this->reflactionTriangleCount = -1;
+	this->verticesPacked = false;
 
 	//graphic configurations
 	initgraph(width, height);
@@ -39,14 +44,35 @@ void UT3D::init(int width, int height, RenderMode renderMode) {
 	ege::setbkcolor(0);
 	ege::setcolor(0xffffff);
 
+	Profiler::setThreadName("main");
 	this->mainCamera = new Camera();
-	mainCamera->bindVertices(&vertices);
+	mainCamera->setName("main");
+	__bindVertices(mainCamera);
 	mainCamera->bindTriangles(&triangles);
 	mainCamera->setCamera(width, height, renderMode);
+
+	//shaded rows go straight into the screen buffer, no per-pixel drawing
+	mainCamera->setPresentTarget((unsigned int*)getbuffer((PIMAGE)NULL));
+
+	this->postProcessor = new PostProcessor();
+
+	frameImages[0] = newimage(width, height);
+	frameImages[1] = newimage(width, height);
+	frameImageIndex = 0;
+	framePending = false;
+
+	frameBudget = 0.0f;
+	minRenderScale = 0.5f;
+	renderScale = 1.0f;
 }
 
 void UT3D::onFinish() {
 	delete mainCamera;
+	delete postProcessor;
+	if (reflactionCamera) delete reflactionCamera;
+
+	delimage(frameImages[0]);
+	delimage(frameImages[1]);
 
 	vertices.clear();
 	triangles.clear();
@@ -61,18 +87,49 @@ void UT3D::clearDevice() {
 
 //basic model setup functions
 void UT3D::addVertex(const ver& vertex) {
+	//no camera reads vertices once they are packed
+	assert(!verticesPacked);
+	if (verticesPacked) return;
 	vertices.push_back(vertex);
 }
 
+void UT3D::packVertices() {
+	if (verticesPacked) return;
+	flush(); //the frame in flight may still read the vertices
+	packedVertices.pack(vertices);
+	vertices.clear();
+	vertices.shrink_to_fit();
+	verticesPacked = true;
+
+	__bindVertices(mainCamera);
+	if (reflactionCamera) __bindVertices(reflactionCamera);
+	for (auto it = lightings.begin();it != lightings.end();++it) {
+		__bindVertices((*it)->getCamera());
+	}
+}
+
+int UT3D::getVertexCount() {
+	return verticesPacked ? packedVertices.size() : vertices.size();
+}
+
+void UT3D::__bindVertices(Camera* camera) {
+	if (verticesPacked) {
+		camera->bindVertices(&packedVertices);
+	} else {
+		camera->bindVertices(&vertices);
+	}
+}
+
 void UT3D::addTriangle(int a, int b, int c) {
 	triangles.push_back(tri(a, b, c));
+	mainCamera->invalidateEdges();
 }
 
 void UT3D::addTexture(const char* path) {
 	textureBuffer.emplace_back(Texture(path));
 }
 
-int UT3D::setReflaction(const vec3& pos, const vec3& normal) {
+int UT3D::setReflaction(const vec3& pos, const vec3& normal, float scale) {
 	float dist = pos.dot(normal); //shortest distance from the origin to the plane
 	float x = -normal(0),
 		y = normal(1),
@@ -85,12 +142,22 @@ int UT3D::setReflaction(const vec3& pos, const vec3& normal) {
 				-2 * x * z, -2 * y * z, 1 - 2 * z * z, -2 * z * dist,
 				0, 0, 0, 1;
 
-	mainCamera->setReflaction(reflaction);
-
-	textureBuffer.emplace_back(Texture(
-		mainCamera->getScreenWidth(),
-		mainCamera->getScreenHeight()
-	));
+	//the texture is sampled by normalized screen coordinates, so any size works
+	int width = max(1, int(mainCamera->getScreenWidth() * scale)),
+		height = max(1, int(mainCamera->getScreenHeight() * scale));
+	if (reflactionCamera) delete reflactionCamera;
+	reflactionCamera = new Camera();
+	reflactionCamera->setName("reflaction");
+	__bindVertices(reflactionCamera);
+	reflactionCamera->bindTriangles(&triangles);
+	reflactionCamera->setCamera(width, height, NORMAL);
+	reflactionCamera->setReflaction(reflaction);
+	//the texture views the color buffer of the last mirrored frame
+	reflactionCamera->setDoubleBuffer(true);
+	reflactionPlane << normal, -dist;
+	reflactionTriangleCount = -1;
+
+	textureBuffer.emplace_back(Texture(width, height));
 	return this->reflactionTextureIndex = textureBuffer.size() - 1;
 }
 
@@ -118,13 +185,176 @@ const Stat& UT3D::getRenderStat() {
 	return mainCamera->getRenderStat();
 }
 
+void UT3D::setVisibilityBuffer(bool enable) {
+	flush();
+	mainCamera->setVisibilityBuffer(enable);
+}
+
+void UT3D::setTiledRendering(bool enable) {
+	flush();
+	mainCamera->setTiledRendering(enable);
+}
+
+void UT3D::setDepthSort(bool enable) {
+	mainCamera->setDepthSort(enable);
+}
+
+void UT3D::setOcclusionCulling(bool enable) {
+	mainCamera->setOcclusionCulling(enable);
+}
+
+//FNV-1a over the bytes
+static unsigned int _hashBytes(unsigned int hash, const void* data, size_t size) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0;i < size;++i) {
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	return hash;
+}
+
+//positions are hashed as the packed ones, so that packing doesn't change the hash
+unsigned int UT3D::__hashScene() {
+	unsigned int hash = 2166136261u;
+	if (!triangles.empty()) {
+		hash = _hashBytes(hash, triangles.data(), sizeof(tri) * triangles.size());
+	}
+	if (verticesPacked) {
+		int size = packedVertices.size();
+		hash = _hashBytes(hash, packedVertices.positionX.data(), sizeof(float) * size);
+		hash = _hashBytes(hash, packedVertices.positionY.data(), sizeof(float) * size);
+		hash = _hashBytes(hash, packedVertices.positionZ.data(), sizeof(float) * size);
+	} else {
+		for (int axis = 0;axis < 3;++axis) {
+			for (auto it = vertices.begin();it != vertices.end();++it) {
+				float p = it->position(axis) / it->position(3);
+				hash = _hashBytes(hash, &p, sizeof(float));
+			}
+		}
+	}
+	return hash;
+}
+
+//a cube of views at every sample, depth alone at a low resolution is enough to tell
+//which clusters are seen, the sets are as good as the samples cover the cells
+void UT3D::bakeVisibilitySets(const vec3& minCorner, const vec3& maxCorner, float cellSize,
+	int samples, int resolution) {
+	flush();
+	Camera* camera = new Camera();
+	camera->setName("visibility");
+	__bindVertices(camera);
+	camera->bindTriangles(&triangles);
+	camera->setCamera(resolution, resolution, DEPTH);
+	camera->setPerspective(90.0f);
+
+	VisibilitySets& sets = visibilitySets;
+	vec3 cells = (maxCorner - minCorner) / cellSize;
+	sets.origin = minCorner;
+	sets.cellSize = cellSize;
+	sets.cellsX = max(1, int(ceil(cells(0))));
+	sets.cellsY = max(1, int(ceil(cells(1))));
+	sets.cellsZ = max(1, int(ceil(cells(2))));
+	sets.triangles = triangles.size();
+	sets.scene = __hashScene();
+	sets.rowBytes = (camera->getClusterCount() + 7) / 8;
+	sets.bits.assign(size_t(sets.cellsX) * sets.cellsY * sets.cellsZ * sets.rowBytes, 0);
+
+	//directions and ups of the faces of a cube
+	const vec3 lookats[6] = { vec3(0, 1, 0), vec3(0, -1, 0), vec3(1, 0, 0),
+		vec3(-1, 0, 0), vec3(0, 0, 1), vec3(0, 0, -1) };
+	const vec3 ups[6] = { vec3(0, 0, 1), vec3(0, 0, 1), vec3(0, 0, 1),
+		vec3(0, 0, 1), vec3(0, 1, 0), vec3(0, 1, 0) };
+	for (int z = 0;z < sets.cellsZ;++z) {
+		for (int y = 0;y < sets.cellsY;++y) {
+			for (int x = 0;x < sets.cellsX;++x) {
+				camera->setClusterRecord(sets.bits.data()
+					+ (size_t(z * sets.cellsY + y) * sets.cellsX + x) * sets.rowBytes);
+				for (int i = 0;i < samples * samples * samples;++i) {
+					vec3 sample(i % samples + 0.5f, i / samples % samples + 0.5f, i / samples / samples + 0.5f);
+					camera->setPosition(minCorner + (vec3(x, y, z) + sample / samples) * cellSize);
+					for (int face = 0;face < 6;++face) {
+						camera->setLookat(lookats[face]);
+						camera->setUp(ups[face]);
+						camera->render();
+					}
+				}
+			}
+		}
+	}
+	delete camera;
+	mainCamera->setVisibilitySets(&visibilitySets);
+}
+
+bool UT3D::saveVisibilitySets(const char* path) {
+	return visibilitySets.save(path);
+}
+
+bool UT3D::loadVisibilitySets(const char* path) {
+	bool loaded = visibilitySets.load(path) && visibilitySets.triangles == int(triangles.size())
+		&& visibilitySets.scene == __hashScene();
+	mainCamera->setVisibilitySets(loaded ? &visibilitySets : nullptr);
+	return loaded;
+}
+
+void UT3D::setHiddenLine(bool enable) {
+	flush();
+	mainCamera->setHiddenLine(enable);
+}
+
+void UT3D::setHeatmapEnable(bool enable) {
+	mainCamera->setHeatmapEnable(enable);
+}
+
+bool UT3D::saveHeatmap(const char* path, HeatmapType type) {
+	int width = mainCamera->getViewportWidth(),
+		height = mainCamera->getViewportHeight();
+	vector<unsigned int> colors(width * height);
+	if (!mainCamera->getHeatmap(type, colors.data())) return false;
+
+	ofstream out(path, ios::binary);
+	if (out.is_open() == false) {
+		return false;
+	}
+	out << "P6\n" << width << " " << height << "\n255\n";
+	vector<unsigned char> row(width * 3);
+	for (int y = 0;y < height;++y) {
+		for (int x = 0;x < width;++x) {
+			unsigned int color = colors[y * width + x];
+			row[x * 3] = color >> 16 & 0xff;
+			row[x * 3 + 1] = color >> 8 & 0xff;
+			row[x * 3 + 2] = color & 0xff;
+		}
+		out.write((const char*)row.data(), row.size());
+	}
+	out.close();
+	return true;
+}
+
+void UT3D::setFrameBudget(float budget, float minScale) {
+	frameBudget = budget;
+	minRenderScale = minScale;
+	if (budget > 0.0f) {
+		mainCamera->setStatEnable(true); //the budget is measured by the stat
+	} else if (renderScale != 1.0f) {
+		renderScale = 1.0f;
+		mainCamera->setViewport(WIN_WIDTH, WIN_HEIGHT);
+	}
+}
+
+float UT3D::getRenderScale() {
+	return renderScale;
+}
+
 //add lighting into scene
 void UT3D::addLighting(Light* light) {
-	light->getCamera()->bindVertices(&vertices);
+	__bindVertices(light->getCamera());
 	light->getCamera()->bindTriangles(&triangles);
 	lightings.push_back(light);
 }
 
+void UT3D::addPostPass(PostPass* pass) {
+	postProcessor->addPass(pass);
+}
+
 //return pairs of texture name and texture index
 map<string, int>* _loadMTL(const string& dir, const string& path) {
 	ifstream in(dir + path);
@@ -176,6 +406,8 @@ map<string, int>* _loadMTL(const string& dir, const string& path) {
 //the code is to be simplified
 //only for .obj format
 void UT3D::loadModel(const char* dir, const char* file) {
+	assert(!verticesPacked);
+	if (verticesPacked) return;
 	string path = dir; //direction of model
 
 	ifstream in(path + file);
@@ -293,7 +525,7 @@ void UT3D::loadModel(const char* dir, const char* file) {
 
 			//cut faces into triangles, anti-clockwise
 			ia = vbase + (*atri)[0];
-			for (int i = 1;i < atri->size() - 1;++i) {
+			for (int i = 1;i < int(atri->size()) - 1;++i) {
 				ib = vbase + (*atri)[i]; ic = vbase + (*atri)[i + 1];
 				UT3D::addTriangle(ia, ib, ic);
 				//texture index
@@ -341,38 +573,140 @@ void UT3D::drawPixel(const ver& v) {
 
 //geometry stage pipeline, base on triangles
 void UT3D::draw(float deltaTime) {
-	static float t = 0.0f;
-	float temp = sin(t + deltaTime) - sin(t);
-	t += deltaTime;
+	if (frameBudget > 0.0f) { //scaled frames are upscaled from a back buffer
+		drawAsync(deltaTime);
+		flush();
+		return;
+	}
+	flush();
+	__drawScene(deltaTime, (unsigned int*)getbuffer((PIMAGE)NULL), nullptr);
+	mainCamera->waitForFrame();
+	//final render result has been presented row by row by the frame threads
+}
+
+//frame N is shaded into one back buffer while frame N + 1 runs its geometry
+//stage and shadow bakes, then N is shown and N + 1 goes to the other buffer
+std::future<void> UT3D::drawAsync(float deltaTime) {
+	auto done = std::make_shared<std::promise<void> >();
+	std::future<void> ret = done->get_future();
+
+	__drawScene(deltaTime, (unsigned int*)getbuffer(frameImages[frameImageIndex]),
+		[done]() { done->set_value(); });
+	frameWidths[frameImageIndex] = mainCamera->getViewportWidth();
+	frameHeights[frameImageIndex] = mainCamera->getViewportHeight();
+
+	//the main camera has waited for the previous frame before rasterizing
+	if (framePending) __showFrame(frameImageIndex ^ 1);
+	framePending = true;
+	frameImageIndex ^= 1;
+	return ret;
+}
+
+void UT3D::flush() {
+	mainCamera->waitForFrame();
+	if (framePending) {
+		__showFrame(frameImageIndex ^ 1);
+		framePending = false;
+	}
+}
+
+//the viewport is at the top-left of the back buffer
+void UT3D::__showFrame(int index) {
+	ProfileZone zone("present");
+	if (frameWidths[index] == WIN_WIDTH && frameHeights[index] == WIN_HEIGHT) {
+		putimage(0, 0, frameImages[index]);
+	} else {
+		putimage(0, 0, WIN_WIDTH, WIN_HEIGHT, frameImages[index],
+			0, 0, frameWidths[index], frameHeights[index]);
+	}
+}
+
+//rasterization and shading grow with the pixel count, so the scale that fits them
+//into what the budget leaves after geometry is estimated from the last frame
+//it only moves a little every frame to stay stable under noisy timings
+void UT3D::__updateRenderScale() {
+	if (frameBudget <= 0.0f) return;
+	const Stat& stat = mainCamera->getRenderStat();
+	float pixelTime = (stat.rasterizationTime + stat.lightingTime) / (renderScale * renderScale);
+	if (pixelTime <= 0.0f) return; //nothing measured yet
+	float scale = sqrt(max(0.0f, frameBudget - stat.geometryTime) / pixelTime);
+	scale = min(max(scale, renderScale - 0.05f), renderScale + 0.05f);
+	scale = min(max(scale, minRenderScale), 1.0f);
+	//a new viewport waits for the frame in flight, not worth it for tiny changes
+	if (scale == renderScale
+		|| (abs(scale - renderScale) < 0.02f && scale != 1.0f && scale != minRenderScale)) {
+		return;
+	}
+	renderScale = scale;
+	mainCamera->setViewport(int(WIN_WIDTH * scale + 0.5f), int(WIN_HEIGHT * scale + 0.5f));
+}
+
+//render the mirrored view into the reflaction texture
+//only the mirror on screen is rendered, and nothing behind the mirror plane
+void UT3D::__drawReflaction() {
+	ProfileZone zone("reflaction");
+	//the mirror is made of the triangles using the reflaction texture
+	if (reflactionTriangleCount != int(triangles.size())) {
+		reflactionTriangles.clear();
+		for (auto it = triangles.begin();it != triangles.end();++it) {
+			int texIndex = verticesPacked ? packedVertices.getTexIndex((*it)(0)) : vertices[(*it)(0)].texIndex;
+			if (texIndex == reflactionTextureIndex) {
+				reflactionTriangles.push_back(*it);
+			}
+		}
+		reflactionTriangleCount = triangles.size();
+	}
+
+	reflactionCamera->copyView(*mainCamera);
+	//keep the side of the eye, the plane is moved a bit behind the mirror
+	//so that surfaces touching the mirror show no seams at its edges
+	vec4 plane = reflactionPlane;
+	if (plane.head(3).dot(mainCamera->getPosition()) + plane(3) < 0) plane = -plane;
+	plane(3) += 10.0f;
+	reflactionCamera->setClipPlane(plane);
+	reflactionCamera->setStencil(reflactionTriangles.empty() ? nullptr : &reflactionTriangles);
+	reflactionCamera->render();
+
+	//the frame in flight still samples the other color buffer,
+	//switch the texture over to the new one once it is shaded
+	mainCamera->waitForFrame();
+	textureBuffer[reflactionTextureIndex].bindArray(
+		(const unsigned int*)reflactionCamera->getColorBuffer(),
+		reflactionCamera->getScreenWidth(),
+		reflactionCamera->getScreenHeight()
+	);
+}
+
+//render the whole scene, the main pass is left in flight
+void UT3D::__drawScene(float deltaTime, unsigned int* target, std::function<void()> onFinish) {
+	ProfileZone zone("draw scene");
+	__updateRenderScale();
 
 	for (auto it = lightings.begin();
 		it != lightings.end();++it) {
-		//(*it)->translateBy(vec3(100 * temp, 0, 100 * temp));
+		//the shadowmap is still read by the frame in flight
+		if ((*it)->needBake()) mainCamera->waitForFrame();
+		ProfileZone bakeZone("shadow bake");
 		(*it)->bakeShadowmap();
 	}
 
 	if (reflactionTextureIndex != -1) {
-		mainCamera->render();
-		//copy camera output into texture
-		textureBuffer[reflactionTextureIndex].loadFromArray(
-			(const unsigned int*)mainCamera->getColorBuffer(),
-			mainCamera->getScreenWidth(),
-			mainCamera->getScreenHeight()
-		);
-		mainCamera->reflactionEnable(false);
-		mainCamera->render();
-		mainCamera->reflactionEnable(true);
-	} else {
-		mainCamera->render();
+		__drawReflaction();
 	}
-
-	//output final render result
-	const int* cptr = mainCamera->getColorBuffer();
-	for (int y = 0;y < WIN_HEIGHT;++y) {
- 		for (int x = 0;x < WIN_WIDTH;++x) {
-			if (*cptr) drawPixel(x, y, *cptr);
-			++cptr;
-		}
+	if (postProcessor->empty()) {
+		mainCamera->setPresentTarget(target);
+		mainCamera->renderAsync(onFinish);
+	} else {
+		//rows are shaded straight into the float planes of the chain,
+		//which presents the whole frame once it is shaded
+		PostFrame& frame = postProcessor->getFrame(
+			mainCamera->getViewportWidth(), mainCamera->getViewportHeight());
+		mainCamera->setPresentTarget(nullptr);
+		mainCamera->setFloatTarget(frame.r, frame.g, frame.b);
+		mainCamera->renderAsync([this, target, onFinish]() {
+			postProcessor->process(target, WIN_WIDTH);
+			if (onFinish) onFinish();
+		});
 	}
 
 	/*
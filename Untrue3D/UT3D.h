@@ -9,7 +9,10 @@ Interface class between users and basic implementation
 #include "untrue_type.h"
 #include "Camera.h"
 #include "Light.h"
+#include "PostProcess.h"
 
+#include <functional>
+#include <future>
 #include <vector>
 
 namespace untrue {
@@ -22,6 +25,8 @@ namespace untrue {
 		//Basic graphics data set
 		std::vector<tri> triangles;
 		std::vector<ver, Eigen::aligned_allocator<ver> > vertices;
+		//compact copy of vertices after packVertices()
+		PackedVertices packedVertices;
 		std::vector<Texture> textureBuffer;
 		std::vector<Light*> lightings;
 
@@ -32,8 +37,12 @@ namespace untrue {
 
 		void addLighting(Light*);
 
+		//post passes run in order over every shaded frame, they are owned by the caller
+		void addPostPass(PostPass*);
+
 		//return texture index of reflaction texture
-		int setReflaction(const vec3& pos, const vec3& normal);
+		//the mirrored view can be rendered at a lower resolution by scale
+		int setReflaction(const vec3& pos, const vec3& normal, float scale = 1.0f);
 
 		void setPerspective(float fov);
 		void setOrthogonal(float f = 90000.0f);
@@ -44,16 +53,59 @@ namespace untrue {
 		void setStatEnable(bool);
 		const Stat& getRenderStat();
 
+		//see Camera::setVisibilityBuffer()
+		void setVisibilityBuffer(bool);
+		//see Camera::setTiledRendering()
+		void setTiledRendering(bool);
+		//see Camera::setDepthSort()
+		void setDepthSort(bool);
+		//see Camera::setOcclusionCulling()
+		void setOcclusionCulling(bool);
+		//see Camera::setHiddenLine()
+		void setHiddenLine(bool);
+
+		//offline, cut the box from minCorner to maxCorner into cells of cellSize and find the clusters
+		//of triangles seen from samples^3 points of every cell, looking along the 6 axes at resolution^2
+		//call it once the scene is loaded, the main camera uses the sets right away
+		void bakeVisibilitySets(const vec3& minCorner, const vec3& maxCorner, float cellSize,
+			int samples = 2, int resolution = 128);
+		bool saveVisibilitySets(const char* path);
+		//false if the file is missing, of another format or was baked for another scene
+		bool loadVisibilitySets(const char* path);
+
+		//heatmaps of the main camera, saved as binary ppm so that no window is needed
+		void setHeatmapEnable(bool);
+		bool saveHeatmap(const char* path, HeatmapType type);
+
+		//scale the resolution of the main camera so that its geometry, rasterization
+		//and shading fit in budget ms, frames are upscaled when shown, 0 to disable
+		void setFrameBudget(float budget, float minScale = 0.5f);
+		float getRenderScale();
+
 		//Graphics data managing functions
-			//ֶģ
+			//手动管理模型数据
 		void addVertex(const ver&);
 		void addTriangle(int, int, int);
 		void addTexture(const char*);
 		void loadModel(const char* dir, const char* filename);
 
+		//move vertices into the compact format, about a third of the memory
+		//call it once the scene is loaded, vertices are released and can't be edited afterwards,
+		//adding vertices or models after it is refused
+		void packVertices();
+		int getVertexCount();
+
 		//just call it every frame after finishing all setups
 		void draw(float deltaTime = 0.0f);
 
+		//non-blocking version of draw(), the frame is shaded into a back buffer
+		//while the caller goes on, and shown by the next drawAsync() or flush()
+		//the future is ready once the frame has been shaded
+		std::future<void> drawAsync(float deltaTime = 0.0f);
+
+		//wait for the frame in flight and show it
+		void flush();
+
 		//drawing section
 		void drawPixel(const ver&);
 		void drawPixel(int, int, UINT32);
@@ -66,5 +118,36 @@ namespace untrue {
 		static UT3D* __inst;
 
 		int reflactionTextureIndex;
+
+		bool verticesPacked;
+
+		PostProcessor* postProcessor;
+
+		//the mirrored view has its own camera, restricted to the mirror on screen
+		Camera* reflactionCamera;
+		vec4 reflactionPlane;
+		//triangles textured by the reflaction texture, used as stencil
+		std::vector<tri> reflactionTriangles;
+		int reflactionTriangleCount;
+
+		//back buffers of the pipelined drawing
+		PIMAGE frameImages[2];
+		int frameImageIndex;
+		bool framePending;
+		//viewport of every back buffer, for upscaling
+		int frameWidths[2], frameHeights[2];
+
+		//dynamic resolution
+		float frameBudget, minRenderScale, renderScale;
+
+		//potentially visible sets of the main camera
+		VisibilitySets visibilitySets;
+
+		void __drawScene(float deltaTime, unsigned int* target, std::function<void()> onFinish);
+		void __drawReflaction();
+		void __updateRenderScale();
+		void __showFrame(int index);
+		void __bindVertices(Camera*);
+		unsigned int __hashScene();
 	};
 };
@@ -47,6 +47,7 @@ Requirement:
 #include <algorithm>
 #include <cmath>
 #include <string>
+#include <thread>
 #include <vector>
 
 using namespace Eigen;
@@ -57,11 +58,21 @@ using namespace untrue;
 //enable to show render info
 #define UNTRUE_STAT
 
+//enable to scale the resolution for the frame time
+//#define UNTRUE_ADAPTIVE
+
+//enable to bake the potentially visible sets of the scene into VISIBILITY_FILE at start
+//#define UNTRUE_BAKE_VISIBILITY
+const char* VISIBILITY_FILE = "scene.pvs";
+
+#ifdef _MSC_VER
+#pragma comment(lib, "winmm.lib") //timeBeginPeriod()
+#endif
+
 const float aspect = 16.0f / 9.0f;
 const int WIN_WIDTH = 800;
 const int WIN_HEIGHT = WIN_WIDTH / aspect;
 const float FPS = 60.0f;
-//delay_ms() is not precise, -1 is for performance
 const float ELAPSE = 1000.0f / FPS;
 
 untrue::UT3D* ut;
@@ -179,6 +190,9 @@ void start() {
 	//ut->loadModel("./skull/", "skull.obj");
 	//ut->loadModel("./Cats_obj/", "Cats_obj.obj");
 
+	//the scene is not edited any more
+	ut->packVertices();
+
 	//Config Lightings
 	Light* light = new PointLight(true, 2048);
 	light->setPosition(vec3(20, -1200, 1200));
@@ -191,12 +205,38 @@ void start() {
 	light->setIntensity(50.0f);
 	ut->addLighting(light);
 
+	//Post processing
+	//ut->addPostPass(new Bloom());
+
+	//depth and triangle id per pixel instead of interpolated vertices
+	//ut->setVisibilityBuffer(true);
+	//rasterize and shade tile by tile without full screen buffers
+	//ut->setTiledRendering(true);
+	//front to back, so that hidden fragments are rejected before their payloads
+	ut->setDepthSort(true);
+	//skip objects hidden behind large faces before clipping them
+	ut->setOcclusionCulling(true);
+
+#ifdef UNTRUE_ADAPTIVE
+	//the rest of the frame time is left for shadow maps and presenting
+	ut->setFrameBudget(ELAPSE * 0.75f);
+#endif
+
 	//Config camera
 	ut->setPerspective(70.0f);
 	ut->setCameraPosition(vec3(0, -700, 500));
 	ut->setCameraLookat(vec3(0, 1, 0));
 	ut->setCameraUp(vec3(0, 0, 1));
 
+#ifdef UNTRUE_BAKE_VISIBILITY
+	//cells over the box the camera walks in, takes a while
+	ut->bakeVisibilitySets(vec3(-1000, -1000, 100), vec3(1000, 1000, 900), 200.0f);
+	ut->saveVisibilitySets(VISIBILITY_FILE);
+#else
+	//nothing is skipped if the sets are missing or stale
+	ut->loadVisibilitySets(VISIBILITY_FILE);
+#endif
+
 	//ut->setReflaction(vec3(0, 0, 10), vec3(0.4472, 0, 0.8944));
 }
 
@@ -205,23 +245,44 @@ void paint(float deltaTime) {
 	static float t = 0.0f;
 	t += deltaTime;
 
-	//3D
+	//处理3D漫游
 	InputHandler::handle(deltaTime);
 
-	ut->draw(deltaTime);
+	//shows the previous frame while this one is being shaded
+	ut->drawAsync(deltaTime);
+}
+
+//frames are paced by deadlines ELAPSE apart so that errors don't add up,
+//delay_ms() alone wakes up late by the coarse system timer
+void waitForNextFrame(steady_clock::time_point& deadline) {
+	deadline += microseconds(int(ELAPSE * 1000.0f));
+	auto now = steady_clock::now();
+	if (now > deadline) { //too late, pace from now on
+		deadline = now;
+	} else {
+		//sleep while the deadline is far, then spin the last bit
+		while (deadline - now > milliseconds(2)) {
+			api_sleep(1);
+			now = steady_clock::now();
+		}
+		while (steady_clock::now() < deadline) this_thread::yield();
+	}
+	delay_ms(0); //refresh the window
 }
 
 int main() {
 	auto timeAtFrameStart = steady_clock::now(),
 		timeAtFrameEnd = timeAtFrameStart;
-	float delta, freeTime, computeTime = 0.0f, curDelta = 0.0f,
+	auto deadline = timeAtFrameStart;
+	float delta, curDelta = 0.0f,
 		sumOfDelayTime = 0.0f, curFPS = 0.0f;
 	int fpsTick = 0;
 	const Stat* stat;
 
+	timeBeginPeriod(1); //1 ms sleeping
 	start();
 	while (!InputHandler::needExit) {
-		//ʱ¼
+		//时间记录
 		timeAtFrameEnd = steady_clock::now();
 		//ns to ms
 		delta = (timeAtFrameEnd - timeAtFrameStart).count() / 1000000.0f;
@@ -230,13 +291,9 @@ int main() {
 		sumOfDelayTime += delta;
 		++fpsTick;
 
-		//drawing
-		ut->clearDevice();
+		//drawing, every pixel is overwritten by the present so no clearing is needed
 		paint(delta);
 
-		computeTime = (steady_clock::now() - timeAtFrameStart).count() / 1000000.0f;
-		freeTime = max(0.0f, ELAPSE - computeTime);
-
 		//update FPS every half second
 		if (sumOfDelayTime >= 500.0f) {
 			curFPS = fpsTick * 1000.0f / sumOfDelayTime;
@@ -249,12 +306,20 @@ int main() {
 		stat = &ut->getRenderStat();
 		xyprintf(10, 30, "geometry: %.2lf ms", stat->geometryTime);
 		xyprintf(10, 50, "rasterization: %.2lf ms", stat->rasterizationTime);
-		xyprintf(WIN_WIDTH - 150, 10, "vertices: %d", ut->vertices.size());
+		xyprintf(10, 70, "shading: %.2lf ms", stat->lightingTime);
+		xyprintf(10, 90, "resolution: %d%%", int(ut->getRenderScale() * 100.0f + 0.5f));
+		xyprintf(WIN_WIDTH - 150, 10, "vertices: %d", ut->getVertexCount());
 		xyprintf(WIN_WIDTH - 150, 30, "faces: %d", stat->renderingFaces);
+		xyprintf(WIN_WIDTH - 150, 50, "culled: %d", stat->trianglesCulled);
+		xyprintf(WIN_WIDTH - 150, 70, "clipped: %d", stat->trianglesClipped);
+		xyprintf(WIN_WIDTH - 150, 90, "occluded: %d", stat->trianglesOccluded);
+		xyprintf(WIN_WIDTH - 150, 110, "overdraw: %.2f",
+			stat->fragmentsShaded ? 1.0f * stat->fragmentsPassed / stat->fragmentsShaded : 0.0f);
 #endif
 		
-		delay_ms(freeTime);
+		waitForNextFrame(deadline);
 	}
 
+	timeEndPeriod(1);
 	return 0;
 }
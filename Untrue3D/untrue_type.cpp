@@ -1,6 +1,9 @@
 #include "untrue_type.h"
 #include "graphics.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <fstream> //texture loading
 
 //VERTEX
@@ -97,6 +100,115 @@ Vertex Vertex::operator /(float k)const {
 	return temp /= k;
 }
 
+//PACKED VERTEX
+//round to nearest, tiny values are flushed to zero and huge ones saturate
+static unsigned short _toHalf(float f) {
+	unsigned int bits;
+	memcpy(&bits, &f, sizeof(bits));
+	unsigned short sign = (bits >> 16) & 0x8000;
+	int exponent = int((bits >> 23) & 0xff) - 127 + 15;
+	unsigned int mantissa = bits & 0x7fffff;
+	if (exponent <= 0) return sign;
+	if (exponent >= 31) return sign | 0x7bff;
+	unsigned int half = (exponent << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000) ++half; //may carry into the exponent, which is still right
+	return sign | std::min(half, 0x7bffu);
+}
+
+static float _fromHalf(unsigned short h) {
+	unsigned int exponent = (h >> 10) & 0x1f,
+		bits = (unsigned int)(h & 0x8000) << 16;
+	if (exponent) bits |= ((exponent - 15 + 127) << 23) | ((h & 0x3ff) << 13);
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+static short _toSnorm(float f) {
+	return short(std::round(std::min(std::max(f, -1.0f), 1.0f) * 32767.0f));
+}
+
+//-32768 is never produced by _toSnorm(), it marks a zero normal
+const short _NO_NORMAL = -32768;
+
+static float _signNotZero(float f) {
+	return f >= 0.0f ? 1.0f : -1.0f;
+}
+
+void PackedVertex::pack(const Vertex& v) {
+	float sum = v.normal.cwiseAbs().sum();
+	if (sum == 0.0f) {
+		normal[0] = normal[1] = _NO_NORMAL;
+	} else {
+		//project onto the octahedron, the lower half is folded over the upper one
+		float x = v.normal(0) / sum, y = v.normal(1) / sum;
+		if (v.normal(2) < 0.0f) {
+			float fx = (1.0f - std::abs(y)) * _signNotZero(x);
+			y = (1.0f - std::abs(x)) * _signNotZero(y);
+			x = fx;
+		}
+		normal[0] = _toSnorm(x);
+		normal[1] = _toSnorm(y);
+	}
+
+	uv[0] = _toHalf(v.uv(0));
+	uv[1] = _toHalf(v.uv(1));
+
+	color = 0;
+	for (int i = 0;i < 3;++i) {
+		color = (color << 8) | int(std::min(std::max(v.color(i), 0.0f), 1.0f) * 255.0f + 0.5f);
+	}
+}
+
+void PackedVertex::unpack(Vertex& v) const {
+	if (normal[0] == _NO_NORMAL) {
+		v.normal.setZero();
+	} else {
+		float x = normal[0] / 32767.0f, y = normal[1] / 32767.0f,
+			z = 1.0f - std::abs(x) - std::abs(y);
+		if (z < 0.0f) {
+			float fx = (1.0f - std::abs(y)) * _signNotZero(x);
+			y = (1.0f - std::abs(x)) * _signNotZero(y);
+			x = fx;
+		}
+		v.normal = vec3(x, y, z).normalized();
+	}
+
+	v.uv << _fromHalf(uv[0]), _fromHalf(uv[1]);
+	v.color = Color::toColorVector(color);
+}
+
+void PackedVertices::pack(const std::vector<Vertex, Eigen::aligned_allocator<Vertex> >& vs) {
+	int size = vs.size(), padded = (size + LANE_SIZE - 1) / LANE_SIZE * LANE_SIZE;
+	vertices.resize(size);
+	positionX.assign(padded, 0.0f);
+	positionY.assign(padded, 0.0f);
+	positionZ.assign(padded, 0.0f);
+	ranges.clear();
+	for (int i = 0;i < size;++i) {
+		vertices[i].pack(vs[i]);
+		positionX[i] = vs[i].position(0) / vs[i].position(3);
+		positionY[i] = vs[i].position(1) / vs[i].position(3);
+		positionZ[i] = vs[i].position(2) / vs[i].position(3);
+		if (ranges.empty() || ranges.back().texIndex != vs[i].texIndex
+			|| ranges.back().receiveShadow != vs[i].receiveShadow) {
+			ranges.push_back({ i, i + 1, vs[i].texIndex, vs[i].receiveShadow });
+		} else {
+			ranges.back().end = i + 1;
+		}
+	}
+}
+
+int PackedVertices::size() const {
+	return vertices.size();
+}
+
+int PackedVertices::getTexIndex(int i) const {
+	auto it = std::upper_bound(ranges.begin(), ranges.end(), i,
+		[](int i, const VertexRange& range) { return i < range.begin; });
+	return it == ranges.begin() ? -1 : (it - 1)->texIndex;
+}
+
 //TRIANGLE
 Triangle::Triangle(int a, int b, int c, Texture* tptr) {
 	index[0] = a;
@@ -117,13 +229,15 @@ int Triangle::operator()(int _index) const{
 }
 
 Texture::Texture() {
-	;
+	this->colorData = nullptr;
+	this->isView = false;
 }
 
 //create a black texture of indicated size
 Texture::Texture(int width, int height) {
 	this->width = width;
 	this->height = height;
+	this->isView = false;
 
 	this->colorData = new unsigned int*[height];
 	this->colorData[0] = new unsigned int[height * width];
@@ -137,23 +251,34 @@ Texture::Texture(Texture&& tex) {
 	this->width = tex.width;
 	this->height = tex.height;
 	this->colorData = tex.colorData;
+	this->isView = tex.isView;
 	tex.colorData = nullptr;
 }
 
 //load texture by using EGE's methods
 Texture::Texture(const char* path) {
+	this->colorData = nullptr;
+	this->isView = false;
 	loadFromPath(path);
 }
 
 Texture::Texture(const unsigned int** map, int size) {
+	this->colorData = nullptr;
+	this->isView = false;
 	load(map[0], size);
 }
 
 Texture::~Texture() {
+	__release();
+}
+
+void Texture::__release() {
 	if (colorData) {
-		delete[] colorData[0];
+		if (!isView) delete[] colorData[0];
 		delete[] colorData;
+		colorData = nullptr;
 	}
+	isView = false;
 }
 
 void Texture::load(const unsigned int* map, int size) {
@@ -183,20 +308,31 @@ void Texture::loadFromPath(const char* path) {
 }
 
 void Texture::loadFromArray(const unsigned int* arr, int w, int h) {
-	this->width = w;
-	this->height = h;
-
-	if (this->colorData) {
-		delete[] this->colorData[0];
-		delete[] this->colorData;
+	//the storage is reused while the size keeps the same
+	if (!colorData || isView || w != width || h != height) {
+		__release();
+		this->width = w;
+		this->height = h;
+		this->colorData = new unsigned int*[height];
+		this->colorData[0] = new unsigned int[height * width];
+		for (int i = 1;i < height;++i) {
+			colorData[i] = colorData[i - 1] + width;
+		}
 	}
-	this->colorData = new unsigned int*[height];
-	this->colorData[0] = new unsigned int[height * width];
+	memcpy(colorData[0], arr, sizeof(unsigned int) * width * height);
+}
 
-	memcpy(colorData[0], arr, sizeof(unsigned int) * width);
+void Texture::bindArray(const unsigned int* arr, int w, int h) {
+	if (!isView || h != height) {
+		__release();
+		this->colorData = new unsigned int*[h];
+		this->isView = true;
+	}
+	this->width = w;
+	this->height = h;
+	colorData[0] = const_cast<unsigned int*>(arr); //never written through a view
 	for (int i = 1;i < height;++i) {
 		colorData[i] = colorData[i - 1] + width;
-		memcpy(colorData[i], arr + i * width, sizeof(unsigned int) * width);
 	}
 }
 
@@ -298,7 +434,7 @@ vec3 Color::toColorVector(int rgb) {
 		(rgb >> 16) & 255,
 		(rgb >> 8) & 255,
 		rgb & 255
-	) / 255.0f;
+	) * (1.0f / 255.0f);
 }
 
 //do color adding and ensure it won't be out of value range
@@ -314,3 +450,104 @@ void Color::mul(vec3& color, const vec3& delta) {
 	color(1) = max(0.0f, min(1.0f, color(1) * delta(1)));
 	color(2) = max(0.0f, min(1.0f, color(2) * delta(2)));
 }
+
+//clamp every channel into [0, 1] and pack them, same result as toRGBValue
+//whole lanes first, Eigen only vectorizes the casts of fixed size arrays
+void Color::packSpan(const float* r, const float* g, const float* b, int* rgb, int count) {
+	int i = 0;
+	for (;i + LANE_SIZE <= count;i += LANE_SIZE) {
+		//channel values are within [0, 255], so multiplying is the same as shifting
+		Eigen::Map<lanei>(rgb + i) =
+			(Eigen::Map<const lanef>(r + i).max(0.0f).min(1.0f) * 255.0f).cast<int>() * 65536
+			+ (Eigen::Map<const lanef>(g + i).max(0.0f).min(1.0f) * 255.0f).cast<int>() * 256
+			+ (Eigen::Map<const lanef>(b + i).max(0.0f).min(1.0f) * 255.0f).cast<int>();
+	}
+	int rest = count - i;
+	Eigen::Map<const Eigen::ArrayXf> ar(r + i, rest), ag(g + i, rest), ab(b + i, rest);
+	Eigen::Map<Eigen::ArrayXi>(rgb + i, rest) =
+		(ar.max(0.0f).min(1.0f) * 255.0f).cast<int>() * 65536
+		+ (ag.max(0.0f).min(1.0f) * 255.0f).cast<int>() * 256
+		+ (ab.max(0.0f).min(1.0f) * 255.0f).cast<int>();
+}
+
+void Color::unpackSpan(const int* rgb, float* r, float* g, float* b, int count) {
+	const float k = 1.0f / 255.0f;
+	for (int i = 0;i < count;++i) {
+		r[i] = ((rgb[i] >> 16) & 255) * k;
+		g[i] = ((rgb[i] >> 8) & 255) * k;
+		b[i] = (rgb[i] & 255) * k;
+	}
+}
+
+//VISIBILITY SETS
+//integers and floats are stored in the byte order of the machine, a file of
+//the other byte order fails the version check like an older format does
+static const char _VISIBILITY_MAGIC[4] = { 'U', 'T', 'V', 'S' };
+static const int _VISIBILITY_VERSION = 2;
+
+VisibilitySets::VisibilitySets() {
+	origin.setZero();
+	cellSize = 1.0f;
+	cellsX = cellsY = cellsZ = 0;
+	triangles = rowBytes = 0;
+	scene = 0;
+}
+
+const unsigned char* VisibilitySets::find(const vec3& pos) const {
+	vec3 cell = (pos - origin) / cellSize;
+	int x = int(std::floor(cell(0))), y = int(std::floor(cell(1))), z = int(std::floor(cell(2)));
+	if (x < 0 || x >= cellsX || y < 0 || y >= cellsY || z < 0 || z >= cellsZ) {
+		return nullptr;
+	}
+	return bits.data() + (size_t(z * cellsY + y) * cellsX + x) * rowBytes;
+}
+
+bool VisibilitySets::save(const char* path) const {
+	std::ofstream out(path, std::ios::binary);
+	if (out.is_open() == false) {
+		return false;
+	}
+	int header[7] = { _VISIBILITY_VERSION, cellsX, cellsY, cellsZ, triangles, rowBytes, int(scene) };
+	out.write(_VISIBILITY_MAGIC, sizeof(_VISIBILITY_MAGIC));
+	out.write((const char*)header, sizeof(header));
+	out.write((const char*)origin.data(), sizeof(float) * 3);
+	out.write((const char*)&cellSize, sizeof(float));
+	out.write((const char*)bits.data(), bits.size());
+	return out.good();
+}
+
+//the sets are left empty if the file is missing or broken
+bool VisibilitySets::load(const char* path) {
+	*this = VisibilitySets();
+	std::ifstream in(path, std::ios::binary);
+	if (in.is_open() == false) {
+		return false;
+	}
+	char magic[4];
+	int header[7];
+	vec3 corner;
+	float size;
+	in.read(magic, sizeof(magic));
+	in.read((char*)header, sizeof(header));
+	in.read((char*)corner.data(), sizeof(float) * 3);
+	in.read((char*)&size, sizeof(float));
+	if (!in.good() || memcmp(magic, _VISIBILITY_MAGIC, sizeof(magic)) != 0 || header[0] != _VISIBILITY_VERSION
+		|| size <= 0.0f || header[1] < 0 || header[2] < 0 || header[3] < 0 || header[5] < 0) {
+		return false;
+	}
+	std::vector<unsigned char> data(size_t(header[1]) * header[2] * header[3] * header[5]);
+	in.read((char*)data.data(), data.size());
+	if (in.gcount() != std::streamsize(data.size())) {
+		return false;
+	}
+	cellsX = header[1];
+	cellsY = header[2];
+	cellsZ = header[3];
+	triangles = header[4];
+	rowBytes = header[5];
+	scene = (unsigned int)header[6];
+	origin = corner;
+	cellSize = size;
+	bits.swap(data);
+	return true;
+}
@@ -2,6 +2,8 @@
 
 #include "Eigen/Dense"
 
+#include <vector>
+
 using mat2 = Eigen::Matrix2f;
 using mat3 = Eigen::Matrix3f;
 using mat4 = Eigen::Matrix4f;
@@ -13,6 +15,12 @@ using vec3i = Eigen::Vector3f;
 using vec3f = Eigen::Vector3i;
 using vec2 = Eigen::Vector2f;
 
+//SIMD lanes for batched computation, Eigen maps them onto packets
+const int LANE_SIZE = 8;
+using lanef = Eigen::Array<float, LANE_SIZE, 1>;
+using lanei = Eigen::Array<int, LANE_SIZE, 1>;
+using laneb = Eigen::Array<bool, LANE_SIZE, 1>;
+
 //will support mipmap one day
 struct Texture {
 	Texture(const char* path);
@@ -30,9 +38,17 @@ struct Texture {
 	void loadFromPath(const char* path);
 	void loadFromArray(const unsigned int* arr, int w, int h);
 
+	//view the pixels of arr without copying, rows are bottom-up
+	//arr must stay alive and unchanged while the texture is sampled
+	void bindArray(const unsigned int* arr, int w, int h);
+
 	int width, height;
 private:
 	unsigned int** colorData;
+	//colorData[0] is not owned
+	bool isView;
+
+	void __release();
 };
 
 enum CubeFace {
@@ -90,6 +106,62 @@ struct Vertex {
 };
 using ver = Vertex;
 
+//compact vertex attributes of 12 bytes, positions are kept apart in PackedVertices
+//normals are octahedral encoded into 16-bit pairs, uvs are half floats and colors are 8-bit
+//the sampler clamps uvs to [0, 1], where half floats step by 1/2048 at most, coordinates
+//tiling far beyond it lose precision, e.g. the step is 1/32 at 50
+struct PackedVertex {
+	short normal[2];
+	unsigned short uv[2];
+	unsigned int color;
+
+	void pack(const Vertex&);
+	//all but the position
+	void unpack(Vertex&) const;
+};
+
+//consecutive vertices sharing the per-object attributes
+struct VertexRange {
+	int begin, end;
+	int texIndex;
+	bool receiveShadow;
+};
+
+struct PackedVertices {
+	std::vector<PackedVertex> vertices;
+	std::vector<VertexRange> ranges;
+	//positions as separated streams for the batched transform,
+	//padded with zeros to whole lanes
+	std::vector<float> positionX, positionY, positionZ;
+
+	//a new range starts wherever texIndex or receiveShadow changes
+	void pack(const std::vector<Vertex, Eigen::aligned_allocator<Vertex> >& vs);
+	int size() const;
+
+	int getTexIndex(int i) const;
+};
+
+//potentially visible sets of a static scene, the navigable box is cut into cubic cells
+//and every cell keeps a bit for each cluster of triangles seen from anywhere in it
+struct VisibilitySets {
+	VisibilitySets();
+
+	vec3 origin; //lowest corner of the box
+	float cellSize;
+	int cellsX, cellsY, cellsZ;
+	int triangles; //count of the triangles baked, the sets are ignored for other scenes
+	int rowBytes; //bits of a cell
+	unsigned int scene; //hash of the triangles and vertex positions baked
+	std::vector<unsigned char> bits;
+
+	//bits of the cell containing pos, nullptr out of the box
+	const unsigned char* find(const vec3& pos) const;
+
+	//binary, stored along with the scene
+	bool save(const char* path) const;
+	bool load(const char* path);
+};
+
 /*
 anti-clockwise
 */
@@ -108,5 +180,10 @@ struct Color {
 	static vec3 toColorVector(int);
 	static void add(vec3&, const vec3&);
 	static void mul(vec3&, const vec3&);
+
+	//batched versions working on whole spans of pixels
+	//colors are kept as separated r, g, b channels so that they vectorize
+	static void packSpan(const float* r, const float* g, const float* b, int* rgb, int count);
+	static void unpackSpan(const int* rgb, float* r, float* g, float* b, int count);
 };
 